@@ -0,0 +1,329 @@
+/**
+ *      @file  castor_standin.c
+ *      @brief  Stand-in for CASTOR and FUSE libraries used by benchmarks
+ *
+ * Cthread is implemented with pthreads. RFIO and name server calls work on the
+ * local file system and sleep to simulate round trips to CASTOR:
+ * bench_latency_us for each metadata, open and close request and
+ * bench_read_latency_us for each read which is not covered by the last
+ * rfio_preseek64. Each round trip is counted in bench_round_trips.
+ * =====================================================================================
+ */
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <fuse/fuse.h>
+#include <Cthread_api.h>
+#include "Cns_api.h"
+#include "rfio_api.h"
+#include "stager_client_api.h"
+
+#define BENCH_CTHREAD_MAX 4096
+#define BENCH_FD_MAX 1024
+#define BENCH_PRESEEK_MAX 64
+
+int bench_latency_us = 0;
+int bench_read_latency_us = 0;
+int bench_fail_close = 0;
+int bench_round_trips = 0;
+
+static __thread int rfio_errno = 0;
+
+static void bench_round_trip(int latency_us)
+{
+  __sync_fetch_and_add(&bench_round_trips,1);
+  if (latency_us) usleep(latency_us);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/* Cthread: mutex and condition are identified by address */
+struct bench_cthread
+{
+  void *addr;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static struct bench_cthread cthreads[BENCH_CTHREAD_MAX];
+static int cthreads_count = 0;
+static pthread_mutex_t cthreads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct bench_cthread* bench_cthread_get(void *addr)
+{
+  int i=0;
+  pthread_mutex_lock(&cthreads_lock);
+  for (i=0; i < cthreads_count; i++) {
+    if (cthreads[i].addr == addr) break;
+  }
+  if (i == cthreads_count) {
+    if (BENCH_CTHREAD_MAX == cthreads_count) {
+      fprintf(stderr,"castor_standin: too many Cthread addresses\n");
+      abort();
+    }
+    cthreads[i].addr = addr;
+    pthread_mutex_init(&cthreads[i].mutex,NULL);
+    pthread_cond_init(&cthreads[i].cond,NULL);
+    cthreads_count++;
+  }
+  pthread_mutex_unlock(&cthreads_lock);
+  return &cthreads[i];
+}
+/* ---------------------------------------------------------------------------------- */
+
+int Cthread_init(void) { return 0; }
+
+int Cthread_Create(const char *file, int line, void *(*routine)(void *), void *arg)
+{
+  pthread_t thread;
+  return pthread_create(&thread,NULL,routine,arg) ? -1 : 0;
+}
+
+int Cthread_Create_Detached(const char *file, int line, void *(*routine)(void *), void *arg)
+{
+  pthread_t thread;
+  if (pthread_create(&thread,NULL,routine,arg)) return -1;
+  pthread_detach(thread);
+  return 0;
+}
+
+int Cthread_Join(const char *file, int line, int cid, int **status) { return 0; }
+
+int Cthread_Lock_Mtx(const char *file, int line, void *addr, int timeout)
+{
+  return pthread_mutex_lock(&bench_cthread_get(addr)->mutex);
+}
+
+int Cthread_Unlock_Mtx(const char *file, int line, void *addr)
+{
+  return pthread_mutex_unlock(&bench_cthread_get(addr)->mutex);
+}
+
+int Cthread_Mutex_Destroy(const char *file, int line, void *addr)
+{
+  int i=0;
+  pthread_mutex_lock(&cthreads_lock);
+  for (i=0; i < cthreads_count; i++) {
+    if (cthreads[i].addr != addr) continue;
+    cthreads[i] = cthreads[--cthreads_count];
+    break;
+  }
+  pthread_mutex_unlock(&cthreads_lock);
+  return 0;
+}
+
+int Cthread_Wait_Condition(const char *file, int line, void *addr, int timeout)
+{
+  struct bench_cthread *c = bench_cthread_get(addr);
+  if (0 > timeout) return pthread_cond_wait(&c->cond,&c->mutex);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  ts.tv_sec += timeout;
+  return pthread_cond_timedwait(&c->cond,&c->mutex,&ts);
+}
+
+int Cthread_Cond_Signal(const char *file, int line, void *addr)
+{
+  return pthread_cond_signal(&bench_cthread_get(addr)->cond);
+}
+
+int Cthread_Cond_Broadcast(const char *file, int line, void *addr)
+{
+  return pthread_cond_broadcast(&bench_cthread_get(addr)->cond);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/* FUSE: benchmarks call hooks directly, context is per thread */
+static __thread struct fuse_context context;
+
+struct fuse_context *fuse_get_context(void) { return &context; }
+
+int fuse_opt_parse(struct fuse_args *args, void *data, const struct fuse_opt opts[],
+                                                            fuse_opt_proc_t proc)
+{
+  return 0;
+}
+
+int fuse_opt_add_arg(struct fuse_args *args, const char *arg) { return 0; }
+
+void fuse_opt_free_args(struct fuse_args *args) {}
+
+int fuse_main(int argc, char *argv[], const struct fuse_operations *op, void *user_data)
+{
+  return 0;
+}
+
+void fuse_exit(void *f) {}
+/* ---------------------------------------------------------------------------------- */
+
+/* RFIO over local files */
+static struct iovec64 preseek[BENCH_FD_MAX][BENCH_PRESEEK_MAX];
+static int preseek_count[BENCH_FD_MAX];
+
+int rfio_serrno(void) { return rfio_errno; }
+
+char* rfio_serror(void) { return strerror(rfio_errno); }
+
+/* Keep errno of the failed local call for rfio_serrno */
+static int bench_result(int res)
+{
+  if (-1 == res) rfio_errno = errno;
+  return res;
+}
+
+int rfio_stat(const char *path, struct stat *st)
+{
+  bench_round_trip(bench_latency_us);
+  return bench_result(stat(path,st));
+}
+
+int rfio_fstat64(int fd, struct stat64 *st) { return bench_result(fstat64(fd,st)); }
+
+int rfio_open64(const char *path, int flags, int mode)
+{
+  bench_round_trip(bench_latency_us);
+  int fd = open(path,flags,mode);
+  if (fd >= BENCH_FD_MAX) {
+    close(fd);
+    errno = EMFILE;
+    fd = -1;
+  }
+  if (-1 != fd) preseek_count[fd] = 0;
+  return bench_result(fd);
+}
+
+int rfio_close(int fd)
+{
+  bench_round_trip(bench_latency_us);
+  close(fd);
+  if (bench_fail_close) {
+    rfio_errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+int rfio_read(int fd, void *buf, int size)
+{
+  off64_t offset = lseek64(fd,0,SEEK_CUR);
+  int i=0, hit=0;
+  for (i=0; i < preseek_count[fd] && !hit; i++) {
+    hit = (offset >= preseek[fd][i].iov_base
+           && offset+size <= preseek[fd][i].iov_base+preseek[fd][i].iov_len);
+  }
+  if (!hit) bench_round_trip(bench_read_latency_us);
+  return bench_result(read(fd,buf,size));
+}
+
+int rfio_write(int fd, void *buf, int size) { return bench_result(write(fd,buf,size)); }
+
+off64_t rfio_lseek64(int fd, off64_t offset, int whence)
+{
+  off64_t res = lseek64(fd,offset,whence);
+  if (-1 == res) rfio_errno = errno;
+  return res;
+}
+
+int rfio_preseek64(int fd, struct iovec64 *iov, int count)
+{
+  bench_round_trip(bench_read_latency_us);
+  if (count > BENCH_PRESEEK_MAX) count = BENCH_PRESEEK_MAX;
+  memcpy(preseek[fd],iov,count*sizeof(struct iovec64));
+  preseek_count[fd] = count;
+  return 0;
+}
+
+int rfio_unlink(const char *path)
+{
+  bench_round_trip(bench_latency_us);
+  return bench_result(unlink(path));
+}
+
+int rfio_mkdir(const char *path, int mode)
+{
+  bench_round_trip(bench_latency_us);
+  return bench_result(mkdir(path,mode));
+}
+
+int rfio_rmdir(const char *path)
+{
+  bench_round_trip(bench_latency_us);
+  return bench_result(rmdir(path));
+}
+
+int rfio_chown(const char *path, int uid, int gid) { return 0; }
+/* ---------------------------------------------------------------------------------- */
+
+/* Name server and stager */
+int Cns_lstat(const char *path, struct Cns_filestat *cst)
+{
+  struct stat st;
+  bench_round_trip(bench_latency_us);
+  if (-1 == bench_result(lstat(path,&st))) return -1;
+  memset(cst,0,sizeof(struct Cns_filestat));
+  cst->fileid = st.st_ino;
+  cst->filemode = st.st_mode;
+  cst->nlink = st.st_nlink;
+  cst->uid = st.st_uid;
+  cst->gid = st.st_gid;
+  cst->filesize = st.st_size;
+  cst->atime = st.st_atime;
+  cst->mtime = st.st_mtime;
+  cst->ctime = st.st_ctime;
+  cst->status = 'm';
+  return 0;
+}
+
+int Cns_statcs(const char *path, struct Cns_filestatcs *cst)
+{
+  rfio_errno = ENOSYS;
+  return -1;
+}
+
+int Cns_getsegattrs(const char *path, void *file_uniqueid, int *count,
+                    struct Cns_segattrs **segattrs)
+{
+  *count = 0;
+  *segattrs = NULL;
+  return 0;
+}
+
+Cns_DIR *Cns_opendir(const char *path)
+{
+  rfio_errno = ENOSYS;
+  return NULL;
+}
+
+struct Cns_direnstat *Cns_readdirx(Cns_DIR *dir) { return NULL; }
+
+int Cns_closedir(Cns_DIR *dir) { return 0; }
+
+int Cns_creat(const char *path, mode_t mode)
+{
+  bench_round_trip(bench_latency_us);
+  int fd = open(path,O_CREAT|O_WRONLY|O_TRUNC,mode);
+  if (-1 == bench_result(fd)) return -1;
+  close(fd);
+  return 0;
+}
+
+int Cns_client_setAuthorizationId(uid_t uid, gid_t gid, const char *mech, char *id)
+{
+  return 0;
+}
+
+int Cns_client_resetAuthorizationId(void) { return 0; }
+
+int stage_setid(uid_t uid, gid_t gid) { return 0; }
+
+int stage_resetid(void) { return 0; }
+/* ---------------------------------------------------------------------------------- */
@@ -0,0 +1,107 @@
+/**
+ *      @file  ingest.c
+ *      @brief  Creation of many small files with and without castor_ingest
+ *
+ * Replays untar of small files: getattr and mkdir of each directory, then
+ * create, getattr, write, flush and release of each file. It is done once
+ * directly in CASTOR and once with castor_spool and castor_ingest, where the
+ * time includes the spool_sync barrier, so all files are in CASTOR. CASTOR is
+ * simulated by castor_standin.c with 20 ms per metadata, open and close
+ * request. Hooks go through the request scheduler with the default
+ * castor_sched_slots.
+ *
+ * Usage: castorfs_bench_ingest [number of files] [work directory]
+ * =====================================================================================
+ */
+#define main castorfs_main
+#include "../src/main.c"
+#undef main
+
+#define INGEST_FILES_PER_DIR 50
+
+extern int bench_latency_us;
+
+static int ingest_errors = 0;
+
+static double ingest_untar(int files)
+{
+  char path[PATH_SIZE_MAX];
+  struct timeval start, end;
+  struct fuse_file_info fi;
+  struct stat st;
+  int i=0;
+  gettimeofday(&start,NULL);
+  for (i=0; i < files; i++) {
+    if (0 == i % INGEST_FILES_PER_DIR) {
+      snprintf(path,PATH_SIZE_MAX,"/d%d",i/INGEST_FILES_PER_DIR);
+      if (-ENOENT != cfuse_oper.getattr(path,&st)) ingest_errors++;
+      if (0 != cfuse_oper.mkdir(path,0755)) ingest_errors++;
+    }
+    snprintf(path,PATH_SIZE_MAX,"/d%d/f%d",i/INGEST_FILES_PER_DIR,i);
+    memset(&fi,0,sizeof(fi));
+    if (0 != cfuse_oper.create(path,0644,&fi)) {
+      ingest_errors++;
+      continue;
+    }
+    if (0 != cfuse_oper.getattr(path,&st)) ingest_errors++;
+    if (10 != cfuse_oper.write(path,"0123456789",10,0,&fi)) ingest_errors++;
+    if (0 != cfuse_oper.flush(path,&fi)) ingest_errors++;
+    cfuse_oper.release(path,&fi);
+  }
+  gettimeofday(&end,NULL);
+  return cfuse_elapsed_us(&start,&end)/1e6;
+}
+/* ---------------------------------------------------------------------------------- */
+
+static int ingest_prepare(const char *work, char *root, char *spool_dir)
+{
+  char command[3*PATH_SIZE_MAX];
+  snprintf(root,PATH_SIZE_MAX,"%s/castor",work);
+  snprintf(spool_dir,PATH_SIZE_MAX,"%s/spool",work);
+  snprintf(command,sizeof(command),"rm -rf '%s' '%s' && mkdir -p '%s' '%s'",
+           root,spool_dir,root,spool_dir);
+  return system(command);
+}
+/* ---------------------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+  int files = argc > 1 ? atoi(argv[1]) : 500;
+  const char *work = argc > 2 ? argv[2] : "/tmp/castorfs_bench";
+  char root[PATH_SIZE_MAX], spool_dir[PATH_SIZE_MAX], sync[XATTR_VALUE_SIZE_MAX];
+  mkdir(work,0755);
+
+  castorfs.root = root;
+  castorfs.sched_slots = SCHED_SLOTS_DEFAULT;
+  castorfs.sched_user_slots = (SCHED_SLOTS_DEFAULT-1)/2;
+  castorfs.close_threads = CLOSE_THREADS_DEFAULT;
+  castorfs.close_queue_size = CLOSE_QUEUE_SIZE_DEFAULT;
+  castorfs.spool_uploaders = 16;
+  castorfs.spool_retries = SPOOL_RETRIES_DEFAULT;
+  bench_latency_us = 20000;
+  cfuse_init_xattrlist();
+
+  if (0 != ingest_prepare(work,root,spool_dir)) return 1;
+  cfuse_oper.init(NULL);
+  double direct = ingest_untar(files);
+  cfuse_oper.destroy(NULL);
+  printf("direct: %d files in %.2fs = %.0f files/s\n",files,direct,files/direct);
+
+  if (0 != ingest_prepare(work,root,spool_dir)) return 1;
+  castorfs.spool = spool_dir;
+  castorfs.ingest = 1;
+  cfuse_oper.init(NULL);
+  struct timeval start, end;
+  gettimeofday(&start,NULL);
+  double returned = ingest_untar(files);
+  int len = cfuse_oper.getxattr("/",XATTR_SPOOL_SYNC,sync,sizeof(sync)-1);
+  gettimeofday(&end,NULL);
+  cfuse_oper.destroy(NULL);
+  sync[0 < len ? len : 0] = '\0';
+  double durable = cfuse_elapsed_us(&start,&end)/1e6;
+  printf("ingest: %d files, untar %.2fs, in CASTOR after %.2fs = %.0f files/s, sync=%s\n",
+         files,returned,durable,files/durable,sync);
+  if (ingest_errors) printf("errors=%d\n",ingest_errors);
+  return ingest_errors || 0 != strcmp(sync,"ok");
+}
+/* ---------------------------------------------------------------------------------- */
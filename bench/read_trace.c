@@ -0,0 +1,100 @@
+/**
+ *      @file  read_trace.c
+ *      @brief  Replay of ROOT TTree read pattern against castorfs read batching
+ *
+ * Synthetic TTree trace: each event cluster reads one basket of 2-8 KB from
+ * each of 16 branches, baskets of a cluster lie within 1 MB. Clusters are read
+ * by 8 threads, as by the kernel with several readers of one file. Each read
+ * goes through the castorfs "read" hook and the request scheduler with the
+ * default castor_sched_slots, RFIO is simulated by castor_standin.c with 1 ms
+ * per round trip.
+ *
+ * Usage: castorfs_bench_read <castor_read_window in us> [work directory]
+ * =====================================================================================
+ */
+#define main castorfs_main
+#include "../src/main.c"
+#undef main
+
+#include <pthread.h>
+
+#define TRACE_THREADS 8
+#define TRACE_CLUSTERS 200
+#define TRACE_BRANCHES 16
+#define TRACE_CLUSTER_SIZE (256*1024)
+#define TRACE_BRANCH_STRIDE 40000
+#define TRACE_FILE_SIZE (60*1024*1024)
+
+extern int bench_read_latency_us;
+extern int bench_round_trips;
+
+static struct fuse_file_info trace_fi;
+static int trace_errors = 0;
+
+static void* trace_reader(void *arg)
+{
+  long thread = (long)arg;
+  unsigned int seed = thread;
+  char buf[8192];
+  int cluster=0, branch=0;
+  for (cluster=thread; cluster < TRACE_CLUSTERS; cluster += TRACE_THREADS) {
+    for (branch=0; branch < TRACE_BRANCHES; branch++) {
+      off_t offset = (off_t)cluster*TRACE_CLUSTER_SIZE + branch*TRACE_BRANCH_STRIDE
+                                                       + rand_r(&seed)%4096;
+      size_t size = 2048 + rand_r(&seed)%6144;
+      if ((int)size != cfuse_oper.read("/trace",buf,size,offset,&trace_fi))
+        __sync_fetch_and_add(&trace_errors,1);
+    }
+  }
+  return NULL;
+}
+/* ---------------------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+  if (2 > argc) {
+    fprintf(stderr,"usage: %s <castor_read_window in us> [work directory]\n",argv[0]);
+    return 1;
+  }
+  char root[PATH_SIZE_MAX], file[PATH_SIZE_MAX];
+  snprintf(root,PATH_SIZE_MAX,"%s",argc > 2 ? argv[2] : "/tmp/castorfs_bench");
+  snprintf(file,PATH_SIZE_MAX,"%s/trace",root);
+  mkdir(root,0755);
+  int fd = open(file,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if (-1 == fd || 0 != ftruncate(fd,TRACE_FILE_SIZE)) {
+    perror(file);
+    return 1;
+  }
+  close(fd);
+
+  castorfs.root = root;
+  castorfs.sched_slots = SCHED_SLOTS_DEFAULT;
+  castorfs.sched_user_slots = (SCHED_SLOTS_DEFAULT-1)/2;
+  castorfs.read_window = atoi(argv[1]);
+  castorfs.read_gap = READ_GAP_DEFAULT;
+  castorfs.read_small = READ_SMALL_DEFAULT;
+  bench_read_latency_us = 1000;
+  cfuse_init_xattrlist();
+
+  memset(&trace_fi,0,sizeof(trace_fi));
+  if (0 != cfuse_oper.open("/trace",&trace_fi)) {
+    fprintf(stderr,"could not open %s\n",file);
+    return 1;
+  }
+  bench_round_trips = 0;
+  struct timeval start, end;
+  gettimeofday(&start,NULL);
+  pthread_t threads[TRACE_THREADS];
+  long i=0;
+  for (i=0; i < TRACE_THREADS; i++) pthread_create(&threads[i],NULL,trace_reader,(void*)i);
+  for (i=0; i < TRACE_THREADS; i++) pthread_join(threads[i],NULL);
+  gettimeofday(&end,NULL);
+  cfuse_oper.release("/trace",&trace_fi);
+
+  printf("castor_read_window=%dus reads=%d round_trips=%d time=%.2fs errors=%d\n",
+         castorfs.read_window,TRACE_CLUSTERS*TRACE_BRANCHES,bench_round_trips,
+         cfuse_elapsed_us(&start,&end)/1e6,trace_errors);
+  unlink(file);
+  return trace_errors ? 1 : 0;
+}
+/* ---------------------------------------------------------------------------------- */
@@ -0,0 +1,23 @@
+/* Declarations used by castorfs, for the benchmark stand-in only */
+#ifndef BENCH_CNS_API_H
+#define BENCH_CNS_API_H
+#include <sys/types.h>
+typedef unsigned long long u_signed64;
+#define CA_MAXNAMELEN 231
+#define CA_MAXCKSUMNAMELEN 15
+#define CA_MAXCKSUMLEN 32
+struct Cns_filestat { u_signed64 fileid; mode_t filemode; int nlink; uid_t uid; gid_t gid; u_signed64 filesize; time_t atime, mtime, ctime; short fileclass; char status; };
+struct Cns_filestatcs { u_signed64 fileid; mode_t filemode; int nlink; uid_t uid; gid_t gid; u_signed64 filesize; time_t atime, mtime, ctime; short fileclass; char status; char csumtype[3]; char csumvalue[33]; };
+struct Cns_segattrs { int copyno; int fsec; u_signed64 segsize; int compression; char s_status; char vid[7]; int side; int fseq; unsigned char blockid[4]; char checksum_name[CA_MAXCKSUMNAMELEN+1]; unsigned long checksum; };
+struct Cns_direnstat { u_signed64 fileid; mode_t filemode; int nlink; uid_t uid; gid_t gid; u_signed64 filesize; time_t atime,mtime,ctime; short fileclass; char status; unsigned short d_reclen; char d_name[1]; };
+typedef struct { int dd_fd; } Cns_DIR;
+int Cns_lstat(const char *, struct Cns_filestat *);
+int Cns_statcs(const char *, struct Cns_filestatcs *);
+int Cns_getsegattrs(const char *, void *, int *, struct Cns_segattrs **);
+Cns_DIR *Cns_opendir(const char *);
+struct Cns_direnstat *Cns_readdirx(Cns_DIR *);
+int Cns_closedir(Cns_DIR *);
+int Cns_creat(const char *, mode_t);
+int Cns_client_setAuthorizationId(uid_t, gid_t, const char *, char *);
+int Cns_client_resetAuthorizationId(void);
+#endif
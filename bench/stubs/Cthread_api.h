@@ -0,0 +1,24 @@
+/* Declarations used by castorfs, for the benchmark stand-in only */
+#ifndef BENCH_CTHREAD_API_H
+#define BENCH_CTHREAD_API_H
+int Cthread_init(void);
+int Cthread_Create(const char*, int, void *(*)(void *), void *);
+int Cthread_Create_Detached(const char*, int, void *(*)(void *), void *);
+int Cthread_Lock_Mtx(const char*, int, void *, int);
+int Cthread_Unlock_Mtx(const char*, int, void *);
+int Cthread_Wait_Condition(const char*, int, void *, int);
+int Cthread_Cond_Signal(const char*, int, void *);
+int Cthread_Cond_Broadcast(const char*, int, void *);
+int Cthread_Join(const char*, int, int, int**);
+#define Cthread_create(a,b) Cthread_Create(__FILE__,__LINE__,a,b)
+#define Cthread_create_detached(a,b) Cthread_Create_Detached(__FILE__,__LINE__,a,b)
+#define Cthread_join(a,b) Cthread_Join(__FILE__,__LINE__,a,b)
+#define Cthread_mutex_lock(a) Cthread_Lock_Mtx(__FILE__,__LINE__,a,-1)
+#define Cthread_mutex_unlock(a) Cthread_Unlock_Mtx(__FILE__,__LINE__,a)
+#define Cthread_cond_wait(a) Cthread_Wait_Condition(__FILE__,__LINE__,a,-1)
+#define Cthread_cond_timedwait(a,b) Cthread_Wait_Condition(__FILE__,__LINE__,a,b)
+#define Cthread_cond_signal(a) Cthread_Cond_Signal(__FILE__,__LINE__,a)
+#define Cthread_cond_broadcast(a) Cthread_Cond_Broadcast(__FILE__,__LINE__,a)
+int Cthread_Mutex_Destroy(const char*, int, void *);
+#define Cthread_mutex_destroy(a) Cthread_Mutex_Destroy(__FILE__,__LINE__,a)
+#endif
@@ -0,0 +1,66 @@
+/* Declarations used by castorfs, for the benchmark stand-in only */
+#ifndef BENCH_FUSE_FUSE_H
+#define BENCH_FUSE_FUSE_H
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <stdint.h>
+#include <time.h>
+struct fuse_file_info { int flags; unsigned long fh_old; int writepage; unsigned int direct_io:1; unsigned int keep_cache:1; unsigned int flush:1; unsigned int padding:29; uint64_t fh; uint64_t lock_owner; };
+typedef int (*fuse_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+struct fuse_conn_info { unsigned proto_major, proto_minor, async_read, max_write, max_readahead; unsigned reserved[27]; };
+struct fuse_context { void *fuse; uid_t uid; gid_t gid; pid_t pid; void *private_data; };
+struct fuse_context *fuse_get_context(void);
+struct fuse_operations {
+ int (*getattr)(const char *, struct stat *);
+ int (*readlink)(const char *, char *, size_t);
+ void *getdir;
+ int (*mknod)(const char *, mode_t, dev_t);
+ int (*mkdir)(const char *, mode_t);
+ int (*unlink)(const char *);
+ int (*rmdir)(const char *);
+ int (*symlink)(const char *, const char *);
+ int (*rename)(const char *, const char *);
+ int (*link)(const char *, const char *);
+ int (*chmod)(const char *, mode_t);
+ int (*chown)(const char *, uid_t, gid_t);
+ int (*truncate)(const char *, off_t);
+ void *utime;
+ int (*open)(const char *, struct fuse_file_info *);
+ int (*read)(const char *, char *, size_t, off_t, struct fuse_file_info *);
+ int (*write)(const char *, const char *, size_t, off_t, struct fuse_file_info *);
+ int (*statfs)(const char *, struct statvfs *);
+ int (*flush)(const char *, struct fuse_file_info *);
+ int (*release)(const char *, struct fuse_file_info *);
+ int (*fsync)(const char *, int, struct fuse_file_info *);
+ int (*setxattr)(const char *, const char *, const char *, size_t, int);
+ int (*getxattr)(const char *, const char *, char *, size_t);
+ int (*listxattr)(const char *, char *, size_t);
+ int (*removexattr)(const char *, const char *);
+ int (*opendir)(const char *, struct fuse_file_info *);
+ int (*readdir)(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
+ int (*releasedir)(const char *, struct fuse_file_info *);
+ int (*fsyncdir)(const char *, int, struct fuse_file_info *);
+ void *(*init)(struct fuse_conn_info *conn);
+ void (*destroy)(void *);
+ int (*access)(const char *, int);
+ int (*create)(const char *, mode_t, struct fuse_file_info *);
+ int (*ftruncate)(const char *, off_t, struct fuse_file_info *);
+ int (*fgetattr)(const char *, struct stat *, struct fuse_file_info *);
+ void *lock;
+ int (*utimens)(const char *, const struct timespec tv[2]);
+};
+struct fuse_args { int argc; char **argv; int allocated; };
+#define FUSE_ARGS_INIT(argc, argv) { argc, argv, 0 }
+struct fuse_opt { const char *templ; unsigned long offset; int value; };
+#define FUSE_OPT_KEY(templ, key) { templ, -1U, key }
+#define FUSE_OPT_END { NULL, 0, 0 }
+#define FUSE_OPT_KEY_OPT -1
+typedef int (*fuse_opt_proc_t)(void *data, const char *arg, int key, struct fuse_args *outargs);
+int fuse_opt_parse(struct fuse_args *args, void *data, const struct fuse_opt opts[], fuse_opt_proc_t proc);
+int fuse_opt_add_arg(struct fuse_args *args, const char *arg);
+void fuse_opt_free_args(struct fuse_args *args);
+int fuse_main(int argc, char *argv[], const struct fuse_operations *op, void *user_data);
+void fuse_exit(void *f);
+#endif
@@ -0,0 +1,21 @@
+/* Declarations used by castorfs, for the benchmark stand-in only */
+#ifndef BENCH_RFIO_API_H
+#define BENCH_RFIO_API_H
+#include <sys/types.h>
+#include <sys/stat.h>
+struct iovec64 { off64_t iov_base; int iov_len; };
+int rfio_stat(const char*, struct stat*);
+int rfio_open64(const char*, int, int);
+int rfio_close(int);
+int rfio_read(int, void*, int);
+int rfio_write(int, void*, int);
+off64_t rfio_lseek64(int, off64_t, int);
+int rfio_preseek64(int, struct iovec64*, int);
+int rfio_unlink(const char*);
+int rfio_mkdir(const char*, int);
+int rfio_rmdir(const char*);
+int rfio_chown(const char*, int, int);
+int rfio_serrno(void);
+char* rfio_serror(void);
+int rfio_fstat64(int, struct stat64*);
+#endif
@@ -0,0 +1,7 @@
+/* Declarations used by castorfs, for the benchmark stand-in only */
+#ifndef BENCH_STAGER_CLIENT_API_H
+#define BENCH_STAGER_CLIENT_API_H
+#include <sys/types.h>
+int stage_setid(uid_t, gid_t);
+int stage_resetid(void);
+#endif
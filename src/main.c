@@ -33,8 +33,28 @@
 #define XATTR_CHECKSUM_NAME "user.checksum_name"
 #define XATTR_CHECKSUM "user.checksum"
 #define XATTR_NBSEG "user.nbseg"
+#define XATTR_SCHED_STATS "user.castorfs.sched"
+#define XATTR_SPOOL_SYNC "user.castorfs.spool_sync"
 
 #define CASTOR_ROOT "/castor"
+
+#define CLOSE_THREADS_DEFAULT 2
+#define CLOSE_QUEUE_SIZE_DEFAULT 64
+#define DEFERRED_ERRORS_MAX 64
+#define OPEN_CACHE_SIZE 1024
+#define SCHED_SLOTS_DEFAULT 8
+#define SCHED_CLIENTS_MAX 64
+#define SCHED_PROCESSES_MAX 16
+#define SPOOL_UPLOADERS_DEFAULT 4
+#define SPOOL_RETRIES_DEFAULT 5
+#define SPOOL_HASH_SIZE 4096
+#define SPOOL_BUFFER_SIZE (1024*1024)
+#define SPOOL_RETRY_DELAY_MAX 600
+#define READ_GAP_DEFAULT (64*1024)
+#define READ_SMALL_DEFAULT (32*1024)
+#define READ_BATCH_MAX 64
+#define SPOOL_ERRORS_MAX 64
+#define SPOOL_ERROR_TTL 3600
 #define CASTORFS_OPT(t, p, v) { t, offsetof(struct castorfs, p), v }
 
 #define DEBUG(format, args...)  \
@@ -51,13 +71,18 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <grp.h>
+#include <signal.h>
 
 #include <fuse/fuse.h> /* FUSE */
 #include <Cthread_api.h> /* Castor - Threads */
 #include "Cns_api.h" /* Castor - Oracle Interface */
 #include "rfio_api.h" /* Castor */
+#include "stager_client_api.h" /* Castor - Stager */
 
 /* #####   TYPE DEFINITIONS  -  LOCAL TO THIS SOURCE FILE   ######################### */
 
@@ -72,6 +97,230 @@ struct castorfs
   char *stage_user;
   char *stage_host;
   char *stage_svcclass;
+  int sync_release;
+  int close_threads;
+  int close_queue_size;
+  int no_keep_cache;
+  int multiuser;
+  int sched_slots;
+  int sched_user_slots;
+  int ns_rate;
+  char *spool;
+  int spool_uploaders;
+  int spool_retries;
+  int read_window;
+  int read_gap;
+  int read_small;
+  int ingest;
+};
+
+struct cfuse_spool_entry;
+
+/** Small read waiting to be sent to CASTOR with other reads of the handle */
+struct cfuse_read_request
+{
+  off_t offset;
+  size_t size;
+  char *buf;
+  int result;
+  int done;
+  struct cfuse_read_request *next;
+};
+
+/** Open file handle, stored in fuse_file_info::fh */
+struct cfuse_handle
+{
+  int fd;
+  /** Some data was written through this handle */
+  int written;
+  /** First write error (errno) not yet reported by flush */
+  int error;
+  /** Identity of the process which opened the file, used for CASTOR requests
+   *  of the background close */
+  uid_t uid;
+  gid_t gid;
+  /** Process which opened the file, failed uploads are reported to it */
+  pid_t pid;
+  /** Spool entry if fd is a local spool file */
+  struct cfuse_spool_entry *spool;
+  /** Small reads collected for one preseek, see cfuse_read_batched */
+  struct cfuse_read_request *reads;
+  int reading;
+  /** Next written handle waiting for background commit */
+  struct cfuse_handle *next_closing;
+  char path[PATH_SIZE_MAX];
+};
+
+/** Bounded queue of handles waiting for background rfio_close */
+struct cfuse_close_queue
+{
+  struct cfuse_handle **jobs;
+  int size;
+  int head;
+  int count;
+  /** Number of rfio_close calls in progress */
+  int active;
+  /** Written handles queued or being closed, see cfuse_close_queue_wait */
+  struct cfuse_handle *closing;
+  int stop;
+};
+
+/** Error of background commit, reported by the next open of the file by the
+ *  same user */
+struct cfuse_deferred_error
+{
+  char path[PATH_SIZE_MAX];
+  uid_t uid;
+  int error;
+};
+
+/** File attributes seen at the last open, used to keep kernel page cache */
+struct cfuse_open_cache_entry
+{
+  char path[PATH_SIZE_MAX];
+  u_signed64 fileid;
+  u_signed64 filesize;
+  time_t mtime;
+};
+
+/** Scheduling classes of FUSE requests */
+enum cfuse_sched_class {
+  CFUSE_SCHED_META, /**< short name server requests (stat, readdir, ...) */
+  CFUSE_SCHED_DATA, /**< stager and disk server requests (open, read, ...) */
+  CFUSE_SCHED_CLASSES
+};
+
+/** Process of the scheduler client */
+struct cfuse_sched_process
+{
+  pid_t pid;
+  int running;
+  int waiting;
+  /** Number of the last granted request, see cfuse_sched::granted */
+  unsigned long granted;
+};
+
+/** Client (uid) of the scheduler */
+struct cfuse_sched_client
+{
+  uid_t uid;
+  /** Number of running requests */
+  int running;
+  /** Number of waiting requests */
+  int waiting;
+  /** Number of running and waiting data requests */
+  int data_running;
+  int data_waiting;
+  /** Token bucket for name server requests */
+  double tokens;
+  struct timeval refill;
+  /** Processes with running or waiting requests */
+  struct cfuse_sched_process processes[SCHED_PROCESSES_MAX];
+};
+
+/** Request waiting for the scheduler slot */
+struct cfuse_sched_ticket
+{
+  enum cfuse_sched_class cls;
+  struct cfuse_sched_client *client;
+  struct cfuse_sched_process *process;
+  struct timeval queued;
+  int granted;
+  struct cfuse_sched_ticket *next;
+};
+
+/** Statistics of the scheduling class */
+struct cfuse_sched_stats
+{
+  int running;
+  int waiting;
+  int max_waiting;
+  unsigned long requests;
+  unsigned long long wait_us;
+  unsigned long max_wait_us;
+};
+
+/** Admission of FUSE requests to CASTOR: fair between clients, metadata
+ *  requests first. */
+struct cfuse_sched
+{
+  int running;
+  /** Number of granted requests */
+  unsigned long granted;
+  struct cfuse_sched_ticket *waiting;
+  struct cfuse_sched_client clients[SCHED_CLIENTS_MAX];
+  struct cfuse_sched_stats stats[CFUSE_SCHED_CLASSES];
+};
+
+enum cfuse_spool_state {
+  CFUSE_SPOOL_WRITING,   /**< opened by application */
+  CFUSE_SPOOL_QUEUED,    /**< closed, waiting for upload */
+  CFUSE_SPOOL_UPLOADING,
+  CFUSE_SPOOL_FAILED,    /**< upload failed after all retries, retried rarely */
+  CFUSE_SPOOL_UPLOADED   /**< uploaded, open entry waits for the last close */
+};
+
+/** File written to local spool directory and not uploaded to CASTOR yet.
+ *  Spool directory contains <id>.data and <id>.journal for each entry. */
+struct cfuse_spool_entry
+{
+  unsigned long id;
+  char path[PATH_SIZE_MAX];
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  /** The last process which wrote the file */
+  pid_t pid;
+  enum cfuse_spool_state state;
+  /** Number of open handles */
+  int opened;
+  /** Removed from spool (uploaded, unlinked or created again). Freed after the
+   *  last close and the end of upload. */
+  int detached;
+  int retries;
+  time_t next_try;
+  int error;
+  /** Upload order, used by sync barrier */
+  unsigned long seq;
+  /** Upload failed after all retries at least once */
+  int failed;
+  /** Written during upload, see cfuse_spool_modify */
+  int modified;
+  /** Journal is being written with spool unlocked, see cfuse_spool_journal_update */
+  int journaling;
+  /** State changed after the journal was written */
+  int journal_stale;
+  struct cfuse_spool_entry *hnext;
+  struct cfuse_spool_entry *prev;
+  struct cfuse_spool_entry *next;
+};
+
+/** Failed upload not reported to the writer process yet */
+struct cfuse_spool_error
+{
+  uid_t uid;
+  pid_t pid;
+  int error;
+  time_t time;
+};
+
+struct cfuse_spool
+{
+  /** Entries by path, the newest first */
+  struct cfuse_spool_entry *hash[SPOOL_HASH_SIZE];
+  /** Entries in creation order */
+  struct cfuse_spool_entry *head;
+  struct cfuse_spool_entry *tail;
+  unsigned long next_id;
+  unsigned long queued_seq;
+  /** Failed uploads by writer process, reported by its next flush or fsync
+   *  of written file. Forgotten after SPOOL_ERROR_TTL seconds or when the
+   *  process exits. */
+  struct cfuse_spool_error errors[SPOOL_ERRORS_MAX];
+  /** Number of uploads in progress */
+  int active;
+  int running;
+  int stop;
 };
 
 enum {
@@ -89,6 +338,21 @@ static struct fuse_opt castorfs_opts[] = {
   CASTORFS_OPT("castor_uid=%d",   uid, 0),
   CASTORFS_OPT("castor_gid=%d",   gid, 0),
   CASTORFS_OPT("castor_readonly", readonly,1),
+  CASTORFS_OPT("castor_sync_release", sync_release,1),
+  CASTORFS_OPT("castor_close_threads=%d", close_threads, 0),
+  CASTORFS_OPT("castor_close_queue=%d", close_queue_size, 0),
+  CASTORFS_OPT("castor_no_keep_cache", no_keep_cache,1),
+  CASTORFS_OPT("castor_multiuser", multiuser,1),
+  CASTORFS_OPT("castor_sched_slots=%d", sched_slots, 0),
+  CASTORFS_OPT("castor_sched_user_slots=%d", sched_user_slots, 0),
+  CASTORFS_OPT("castor_ns_rate=%d", ns_rate, 0),
+  CASTORFS_OPT("castor_spool=%s", spool, 0),
+  CASTORFS_OPT("castor_spool_uploaders=%d", spool_uploaders, 0),
+  CASTORFS_OPT("castor_spool_retries=%d", spool_retries, 0),
+  CASTORFS_OPT("castor_read_window=%d", read_window, 0),
+  CASTORFS_OPT("castor_read_gap=%d", read_gap, 0),
+  CASTORFS_OPT("castor_read_small=%d", read_small, 0),
+  CASTORFS_OPT("castor_ingest", ingest,1),
 
   FUSE_OPT_KEY("-V",          KEY_VERSION),
   FUSE_OPT_KEY("--version",   KEY_VERSION),
@@ -109,6 +373,16 @@ static int   xattrlist_segment_len = 0;
  *  the xattrlist_segment_sum_len lenght
  */
 static int   xattrlist_segment_sum_len = 0;
+
+static struct cfuse_close_queue close_queue;
+static struct cfuse_deferred_error deferred_errors[DEFERRED_ERRORS_MAX];
+static int   deferred_errors_next = 0;
+static struct cfuse_open_cache_entry open_cache[OPEN_CACHE_SIZE];
+static struct cfuse_sched sched;
+static const char *sched_class_names[CFUSE_SCHED_CLASSES] = {"meta", "data"};
+static struct cfuse_spool spool;
+static const char *spool_state_names[] = {"writing", "spooled", "uploading", "upload_failed",
+                                             "online"};
 /* #####   PROTOTYPES  -  LOCAL TO THIS SOURCE FILE   ############################### */
 
 /* #####   FUNCTION DEFINITIONS  -  EXPORTED FUNCTIONS   ############################ */
@@ -135,148 +409,1844 @@ static void usage(const char *progname)
 "                             (set environment variable STAGE_HOST)\n"
 "    -o castor_stage_svcclass CASTOR stage service class\n"
 "                             (set environment variable STAGE_SVCCLASS)\n"
+"    -o castor_sync_release   close files synchronously in release\n"
+"    -o castor_close_threads  number of background close threads (default: 2)\n"
+"    -o castor_close_queue    maximum number of files waiting for\n"
+"                             background close (default: 64)\n"
+"    -o castor_no_keep_cache  always drop kernel page cache on open\n"
+"    -o castor_multiuser      access CASTOR as the calling user\n"
+"                             (implies allow_other, should be run as root)\n"
+"    -o castor_sched_slots    maximum number of concurrent CASTOR requests,\n"
+"                             at least 2, 0 disables request scheduling\n"
+"                             (default: 8)\n"
+"    -o castor_sched_user_slots maximum number of data requests of one user\n"
+"                             while other users wait (default: half of data\n"
+"                             slots)\n"
+"    -o castor_ns_rate        maximum name server requests per second\n"
+"                             for each user (default: 0, unlimited)\n"
+"    -o castor_spool          spool directory: new files are written there and\n"
+"                             uploaded to CASTOR in background after close\n"
+"    -o castor_spool_uploaders number of upload threads (default: 4)\n"
+"    -o castor_spool_retries  number of upload attempts (default: 5)\n"
+"    -o castor_read_window    time in microseconds to collect small reads of\n"
+"                             a file into one request (default: 0, disabled)\n"
+"    -o castor_read_gap       maximum gap in bytes between merged reads\n"
+"                             (default: 65536)\n"
+"    -o castor_read_small     maximum size in bytes of collected read\n"
+"                             (default: 32768)\n"
+"    -o castor_ingest         create and mkdir return at once, CASTOR requests\n"
+"                             are made by spool uploaders (needs castor_spool)\n"
 "\n", progname);
 }
 /**
- * @brief  Construct CASTOR absolute path
- * @param  relative_path CASTOR path relative to fuse mount point
- * @return CASTOR absolute path 
+ * @brief  Construct CASTOR absolute path
+ * @param  relative_path CASTOR path relative to fuse mount point
+ * @return CASTOR absolute path 
+ */
+static char* absolute_path(const char* relative_path,char *result)
+{
+   int size = strlen(castorfs.root)+strlen(relative_path)+1;
+   //char* result = (char*)calloc(sizeof(char),size);
+   strncpy(result,castorfs.root,PATH_SIZE_MAX);
+   return strncat(result,relative_path,PATH_SIZE_MAX);
+}
+/* ---------------------------------------------------------------------------------- */
+
+static int cfuse_getsegattrs(const char* relative_path,int *nbseg, 
+                                                          struct Cns_segattrs **xattrs)
+{
+  char path[PATH_SIZE_MAX];
+  absolute_path(relative_path,path);
+  int res = Cns_getsegattrs(path,NULL,nbseg,xattrs);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Helper function
+ *         (1) Add new attribute to attribute list. 
+ *         (2) Increment total length of list. 
+ *         (3) Change list pointer to the end of list
+ * @param  attribute Attribute which sould be added
+ * @param  list Target list (inout).
+ * @param  len Total length of list (out).
+ * @param maxsize Maximum size of added attribute (out)
+ * @see cfuse_init_xattrlist
+ */
+static void _cfuse_add_attribute(const char *attribute,char** list, int *len, int *maxsize)
+{
+  int l = strlen(attribute);
+  memcpy(*list,attribute,l+1);
+  *list = *list+l+1;
+  maxsize = maxsize-l+1;
+  *len += l+1;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Init full list of available attributes.
+ *         When it will be called cfuse_listxattr the list will be reduced 
+ */
+static void cfuse_init_xattrlist()
+{
+   char *current = xattrlist;
+   int max = XATTR_LIST_SIZE_MAX;
+   int len = 0;
+   _cfuse_add_attribute(XATTR_STATUS,&current,&xattrlist_len,&max);
+   _cfuse_add_attribute(XATTR_NBSEG,&current,&xattrlist_len,&max);
+   _cfuse_add_attribute(XATTR_CHECKSUM_NAME,&current,&xattrlist_len,&max);
+   _cfuse_add_attribute(XATTR_CHECKSUM,&current,&xattrlist_len,&max);
+   
+   xattrlist_segment_sum_len = strlen(XATTR_CHECKSUM_NAME)+strlen(XATTR_CHECKSUM)+2;
+
+   int i=1;
+   for (i=1; i <= XATTR_NUM_SEGMENTS_MAX; i++) {
+     char name[XATTR_NAME_SIZE_MAX];
+     snprintf(name,XATTR_NAME_SIZE_MAX,"castor.seg%d.checksum_name",i);
+     if ( i==1 ) xattrlist_segment_len += strlen(name)+1;
+     _cfuse_add_attribute(name,&current,&xattrlist_len,&max);
+     snprintf(name,XATTR_NAME_SIZE_MAX,"castor.seg%d.checksum",i);
+     if ( i==1 ) xattrlist_segment_len += strlen(name)+1;
+     _cfuse_add_attribute(name,&current,&xattrlist_len,&max);
+   }
+}
+/* ---------------------------------------------------------------------------------- */
+static int cfuse_cns_stat(const char *relative_path, struct Cns_filestat *stat)
+{
+  char path[PATH_SIZE_MAX];
+  absolute_path(relative_path,path);
+  int res = Cns_lstat(path,stat);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+static void cfuse_free_segattrs(struct Cns_segattrs **attrs,int size)
+{
+  int i=0;
+  for (i=0;i++;i<size) {
+    struct Cns_segattrs *current = *attrs+i*sizeof(struct Cns_segattrs);
+    free(current);
+  }
+  free(*attrs);
+}
+/* ---------------------------------------------------------------------------------- */
+int cfuse_init_account_fuse()
+{
+  struct group fuse_group, *pfuse_group=NULL;
+  int bufsize = sysconf(_SC_GETGR_R_SIZE_MAX);
+  char *buf;
+
+  buf = malloc(bufsize);
+  getgrnam_r("fuse",&fuse_group,buf,bufsize,&pfuse_group);
+  if (!pfuse_group) {
+      DEBUG("main.c: Can not find group %s","fuse");
+      free(buf);
+      return -1;
+  }
+  if (-1 == setgroups(1,&fuse_group.gr_gid)){
+    DEBUG("main.c: Can not set fuse group for current proccess gid=%d",fuse_group.gr_gid);
+    free(buf);
+    return -1;
+  }
+  free(buf);
+}
+/* ---------------------------------------------------------------------------------- */
+int cfuse_init_account()
+{
+  int res=0;
+  if ( 0 != castorfs.gid ) {
+    res = setgid(castorfs.gid);
+    if ( -1 == res){
+      DEBUG("main.c: could not setup uid to %d\n",castorfs.uid);
+      return -1;
+    }
+
+    /* Add also fuse group */
+    cfuse_init_account_fuse();
+  }
+  if ( 0 != castorfs.uid) {
+    res = setuid(castorfs.uid);
+    if ( -1 == res){
+      DEBUG("main.c: could not setup gid to %d\n",castorfs.gid);
+      return -1;
+    }
+  }
+  return 0;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Set CASTOR identity of the current thread for Cns and stager calls.
+ *         Used only in multiuser mode, otherwise identity of the process is used.
+ * @param  uid
+ * @param  gid
+ * @return 0 or -EACCES if identity was not set: the thread could make requests
+ *         as the previous user
+ */
+static int cfuse_set_identity(uid_t uid, gid_t gid)
+{
+  if (!castorfs.multiuser) return 0;
+  if (0 != Cns_client_setAuthorizationId(uid,gid,"","")) {
+    DEBUG("main.c: could not set name server identity %d:%d\n",uid,gid);
+    return -EACCES;
+  }
+  if (0 != stage_setid(uid,gid)) {
+    DEBUG("main.c: could not set stager identity %d:%d\n",uid,gid);
+    return -EACCES;
+  }
+  return 0;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Act as the user which made current FUSE request
+ * @return 0 or -EACCES
+ */
+static int cfuse_set_caller_identity()
+{
+  struct fuse_context *context = fuse_get_context();
+  return cfuse_set_identity(context->uid,context->gid);
+}
+/* ---------------------------------------------------------------------------------- */
+
+void cfuse_debug_account()
+{
+   DEBUG("uid=%d,gid=%d,euid=%d,egid=%d",getuid(),getgid(),geteuid(),getegid());
+}
+/* ---------------------------------------------------------------------------------- */
+
+static struct cfuse_open_cache_entry* cfuse_open_cache_slot(const char *relative_path)
+{
+  unsigned long hash = 5381;
+  const char *c = relative_path;
+  while (*c) hash = hash*33 + (unsigned char)*c++;
+  return &open_cache[hash % OPEN_CACHE_SIZE];
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Check that file was not changed since the last open
+ * @param  relative_path
+ * @param  stat Current CASTOR attributes of the file
+ * @return 1 if kernel can keep cached pages of the file, 0 otherwise
+ */
+static int cfuse_open_cache_check(const char *relative_path, const struct Cns_filestat *stat)
+{
+  int keep = 0;
+  Cthread_mutex_lock(open_cache);
+  struct cfuse_open_cache_entry *e = cfuse_open_cache_slot(relative_path);
+  if (0 == strcmp(e->path,relative_path) && e->fileid == stat->fileid
+      && e->filesize == stat->filesize && e->mtime == stat->mtime) {
+    keep = 1;
+  } else {
+    strncpy(e->path,relative_path,PATH_SIZE_MAX-1);
+    e->path[PATH_SIZE_MAX-1] = '\0';
+    e->fileid = stat->fileid;
+    e->filesize = stat->filesize;
+    e->mtime = stat->mtime;
+  }
+  Cthread_mutex_unlock(open_cache);
+  return keep;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Forget attributes of the file, so the next open drops kernel cache.
+ *         Should be called when file is changed through castorfs.
+ * @param  relative_path
+ */
+static void cfuse_open_cache_invalidate(const char *relative_path)
+{
+  Cthread_mutex_lock(open_cache);
+  struct cfuse_open_cache_entry *e = cfuse_open_cache_slot(relative_path);
+  if (0 == strcmp(e->path,relative_path)) e->path[0] = '\0';
+  Cthread_mutex_unlock(open_cache);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Remember error of background commit. It will be returned by the next
+ *         open of the same file by the same user.
+ * @param  relative_path
+ * @param  uid
+ * @param  error errno value
+ */
+static void cfuse_deferred_error_put(const char *relative_path, uid_t uid, int error)
+{
+  Cthread_mutex_lock(deferred_errors);
+  struct cfuse_deferred_error *de = &deferred_errors[deferred_errors_next];
+  strncpy(de->path,relative_path,PATH_SIZE_MAX-1);
+  de->path[PATH_SIZE_MAX-1] = '\0';
+  de->uid = uid;
+  de->error = error;
+  deferred_errors_next = (deferred_errors_next+1) % DEFERRED_ERRORS_MAX;
+  Cthread_mutex_unlock(deferred_errors);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Take (and forget) error of background commit of the file written by
+ *         the calling user
+ * @param  relative_path
+ * @return errno value or 0 if there is no pending error
+ */
+static int cfuse_deferred_error_take(const char *relative_path)
+{
+  uid_t uid = fuse_get_context()->uid;
+  int i=0, error=0;
+  Cthread_mutex_lock(deferred_errors);
+  for (i=0; i < DEFERRED_ERRORS_MAX; i++) {
+    struct cfuse_deferred_error *de = &deferred_errors[i];
+    if (de->error && de->uid == uid && 0 == strcmp(de->path,relative_path)) {
+      error = de->error;
+      de->error = 0;
+      break;
+    }
+  }
+  Cthread_mutex_unlock(deferred_errors);
+  return error;
+}
+/* ---------------------------------------------------------------------------------- */
+
+static struct cfuse_handle* cfuse_handle_new(const char *relative_path, int fd)
+{
+  struct cfuse_handle *h = (struct cfuse_handle*)calloc(1,sizeof(struct cfuse_handle));
+  if (NULL == h) return NULL;
+  struct fuse_context *context = fuse_get_context();
+  h->fd = fd;
+  h->uid = context->uid;
+  h->gid = context->gid;
+  h->pid = context->pid;
+  strncpy(h->path,relative_path,PATH_SIZE_MAX-1);
+  return h;
+}
+/* ---------------------------------------------------------------------------------- */
+
+static struct cfuse_handle* cfuse_handle_get(struct fuse_file_info *fi)
+{
+  return (struct cfuse_handle*)(uintptr_t)fi->fh;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Forget written handle which was waiting for background commit and wake
+ *         up requests waiting for it
+ * @param  h
+ */
+static void cfuse_close_queue_done(struct cfuse_handle *h)
+{
+  Cthread_mutex_lock(&close_queue);
+  struct cfuse_handle **prev = &close_queue.closing;
+  while (*prev && *prev != h) prev = &(*prev)->next_closing;
+  if (*prev) {
+    *prev = h->next_closing;
+    Cthread_cond_broadcast(&close_queue);
+  }
+  Cthread_mutex_unlock(&close_queue);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Close CASTOR file and free handle. For written files rfio_close
+ *         commits the file on the disk server, so it can fail and take a while:
+ *         it is a data request of the writer for the scheduler. Failed commit
+ *         is reported by the next open of the file, see cfuse_deferred_error_put.
+ * @param  h
+ * @return 0 or -errno
+ */
+static int cfuse_spool_close(struct cfuse_handle *h);
+static void cfuse_sched_enter_as(struct cfuse_sched_ticket *ticket,
+                                 enum cfuse_sched_class cls, uid_t uid, pid_t pid);
+static void cfuse_sched_enter(struct cfuse_sched_ticket *ticket,
+                              enum cfuse_sched_class cls);
+static void cfuse_sched_leave(struct cfuse_sched_ticket *ticket);
+static int cfuse_handle_close(struct cfuse_handle *h)
+{
+  if (h->spool) return cfuse_spool_close(h);
+  /* Release and close threads may run with identity of another user. The
+   * descriptor is closed anyway, but the file is reported as failed. */
+  int identity = cfuse_set_identity(h->uid,h->gid);
+  struct cfuse_sched_ticket ticket;
+  if (h->written) cfuse_sched_enter_as(&ticket,CFUSE_SCHED_DATA,h->uid,h->pid);
+  int res = rfio_close(h->fd);
+  if (h->written) cfuse_sched_leave(&ticket);
+  if (0 != identity) {
+    res = identity;
+  } else if (-1 == res) {
+    res = -rfio_serrno();
+    DEBUG("cfuse_handle_close: %s: %s\n",h->path,rfio_serror());
+  } else if (h->error) {
+    res = -h->error;
+  }
+  if (h->written) {
+    if (0 > res) cfuse_deferred_error_put(h->path,h->uid,-res);
+    cfuse_open_cache_invalidate(h->path);
+    cfuse_close_queue_done(h);
+  }
+  Cthread_mutex_destroy(h);
+  free(h);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Background close thread. Takes handles from close_queue until stopped
+ *         and the queue is empty.
+ */
+static void* cfuse_close_thread(void *arg)
+{
+  (void)arg;
+  Cthread_mutex_lock(&close_queue);
+  for (;;) {
+    while (0 == close_queue.count && !close_queue.stop)
+      Cthread_cond_wait(&close_queue);
+    if (0 == close_queue.count) break;
+
+    struct cfuse_handle *h = close_queue.jobs[close_queue.head];
+    close_queue.head = (close_queue.head+1) % close_queue.size;
+    close_queue.count--;
+    close_queue.active++;
+    /* Wake up release waiting for a free place */
+    Cthread_cond_broadcast(&close_queue);
+    Cthread_mutex_unlock(&close_queue);
+
+    cfuse_handle_close(h);
+
+    Cthread_mutex_lock(&close_queue);
+    close_queue.active--;
+    Cthread_cond_broadcast(&close_queue);
+  }
+  Cthread_mutex_unlock(&close_queue);
+  return NULL;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Queue handle for background close. Waits while the queue is full, so
+ *         a writer which closes files faster than they are committed is slowed
+ *         down in release.
+ * @param  h
+ * @return 0 on success, -1 if queue is not running
+ */
+static int cfuse_close_queue_put(struct cfuse_handle *h)
+{
+  int res = -1;
+  Cthread_mutex_lock(&close_queue);
+  while (close_queue.jobs && !close_queue.stop && close_queue.count == close_queue.size)
+    Cthread_cond_wait(&close_queue);
+  if (close_queue.jobs && !close_queue.stop) {
+    int tail = (close_queue.head+close_queue.count) % close_queue.size;
+    close_queue.jobs[tail] = h;
+    close_queue.count++;
+    if (h->written) {
+      h->next_closing = close_queue.closing;
+      close_queue.closing = h;
+    }
+    Cthread_cond_broadcast(&close_queue);
+    res = 0;
+  }
+  Cthread_mutex_unlock(&close_queue);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Wait until background commit of the file is finished, so the file is
+ *         complete in CASTOR and its commit error is known. Should be called
+ *         before the scheduler slot is taken: the commit needs a slot itself.
+ * @param  relative_path
+ */
+static void cfuse_close_queue_wait(const char *relative_path)
+{
+  Cthread_mutex_lock(&close_queue);
+  struct cfuse_handle *h = close_queue.closing;
+  while (h) {
+    if (0 != strcmp(h->path,relative_path)) {
+      h = h->next_closing;
+      continue;
+    }
+    Cthread_cond_wait(&close_queue);
+    h = close_queue.closing;
+  }
+  Cthread_mutex_unlock(&close_queue);
+}
+/* ---------------------------------------------------------------------------------- */
+
+static void cfuse_close_queue_start()
+{
+  if (castorfs.sync_release || 0 >= castorfs.close_threads
+      || 0 >= castorfs.close_queue_size) return;
+
+  close_queue.jobs = (struct cfuse_handle**)calloc(castorfs.close_queue_size,
+                                                  sizeof(struct cfuse_handle*));
+  if (NULL == close_queue.jobs) return;
+  close_queue.size = castorfs.close_queue_size;
+
+  int i=0;
+  for (i=0; i < castorfs.close_threads; i++) {
+    if (0 > Cthread_create_detached(cfuse_close_thread,NULL)) {
+      DEBUG("main.c: could not start close thread %d\n",i);
+    }
+  }
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Wait until all queued files are closed and stop close threads
+ */
+static void cfuse_close_queue_stop()
+{
+  if (NULL == close_queue.jobs) return;
+  Cthread_mutex_lock(&close_queue);
+  close_queue.stop = 1;
+  Cthread_cond_broadcast(&close_queue);
+  while (close_queue.count > 0 || close_queue.active > 0)
+    Cthread_cond_wait(&close_queue);
+  Cthread_mutex_unlock(&close_queue);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Name of spool file of the entry
+ * @param  e
+ * @param  suffix "data", "journal" or "tmp"
+ * @param  result
+ * @return result
+ */
+static char* cfuse_spool_file(const struct cfuse_spool_entry *e, const char *suffix,
+                                                                          char *result)
+{
+  snprintf(result,PATH_SIZE_MAX,"%s/%lu.%s",castorfs.spool,e->id,suffix);
+  return result;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Atomically replace journal of the entry. Journal contains state, mode,
+ *         owner and CASTOR path of the file, so uploads can be resumed after crash.
+ * @param  e
+ * @param  state
+ * @param  durable Sync journal to disk. Not needed for "writing" state: such
+ *         entries are not uploaded after crash anyway.
+ * @return 0 or -errno
+ */
+static int cfuse_spool_journal(const struct cfuse_spool_entry *e, const char *state,
+                                                                          int durable)
+{
+  char tmp[PATH_SIZE_MAX], journal[PATH_SIZE_MAX], buf[PATH_SIZE_MAX+64];
+  cfuse_spool_file(e,"tmp",tmp);
+  cfuse_spool_file(e,"journal",journal);
+  int len = snprintf(buf,sizeof(buf),"%s\n%o %d %d\n%s\n",state,e->mode,e->uid,e->gid,
+                                                                              e->path);
+  int fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0600);
+  if (-1 == fd) return -errno;
+  int res = 0;
+  if (len != write(fd,buf,len) || (durable && 0 != fsync(fd))) res = -errno;
+  close(fd);
+  if (0 == res && 0 != rename(tmp,journal)) res = -errno;
+  if (0 != res) {
+    unlink(tmp);
+    return res;
+  }
+  if (!durable) return 0;
+  /* Make rename durable */
+  fd = open(castorfs.spool,O_RDONLY);
+  if (-1 != fd) {
+    fsync(fd);
+    close(fd);
+  }
+  return 0;
+}
+/* ---------------------------------------------------------------------------------- */
+
+static unsigned long cfuse_spool_hash(const char *relative_path)
+{
+  unsigned long hash = 5381;
+  while (*relative_path) hash = hash*33 + (unsigned char)*relative_path++;
+  return hash % SPOOL_HASH_SIZE;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Find the newest spool entry of the file. Should be called with spool
+ *         locked.
+ * @param  relative_path
+ * @return entry or NULL
+ */
+static struct cfuse_spool_entry* cfuse_spool_find(const char *relative_path)
+{
+  struct cfuse_spool_entry *e = spool.hash[cfuse_spool_hash(relative_path)];
+  for (; e; e = e->hnext) {
+    if (!e->detached && 0 == strcmp(e->path,relative_path)) return e;
+  }
+  return NULL;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Add new entry. Should be called with spool locked.
+ * @return entry or NULL
+ */
+static struct cfuse_spool_entry* cfuse_spool_add(unsigned long id, const char *relative_path,
+                                        mode_t mode, uid_t uid, gid_t gid)
+{
+  struct cfuse_spool_entry *e = 
+    (struct cfuse_spool_entry*)calloc(1,sizeof(struct cfuse_spool_entry));
+  if (NULL == e) return NULL;
+  e->id = id;
+  strncpy(e->path,relative_path,PATH_SIZE_MAX-1);
+  e->mode = mode;
+  e->uid = uid;
+  e->gid = gid;
+  e->state = CFUSE_SPOOL_WRITING;
+
+  unsigned long bucket = cfuse_spool_hash(relative_path);
+  e->hnext = spool.hash[bucket];
+  spool.hash[bucket] = e;
+
+  e->prev = spool.tail;
+  if (spool.tail) spool.tail->next = e; else spool.head = e;
+  spool.tail = e;
+  return e;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Free detached entry if it is not used anymore. Entry being uploaded
+ *         stays in hash until the end of upload: the next version of the file
+ *         waits for it. Should be called with spool locked.
+ * @param  e
+ */
+static void cfuse_spool_release(struct cfuse_spool_entry *e)
+{
+  if (!e->detached || CFUSE_SPOOL_UPLOADING == e->state) return;
+  if (e->hnext != e) {
+    struct cfuse_spool_entry **prev = &spool.hash[cfuse_spool_hash(e->path)];
+    while (*prev != e) prev = &(*prev)->hnext;
+    *prev = e->hnext;
+    e->hnext = e;
+  }
+  if (0 == e->opened && !e->journaling) free(e);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Forget entry and remove its spool files. Open handles keep reading
+ *         the unlinked data file, the entry is freed by the last of them or by
+ *         the uploader. Should be called with spool locked.
+ * @param  e
+ */
+static void cfuse_spool_remove(struct cfuse_spool_entry *e)
+{
+  if (!e->detached) {
+    char file[PATH_SIZE_MAX];
+    /* Journal first: data without journal is removed at the next start */
+    unlink(cfuse_spool_file(e,"journal",file));
+    unlink(cfuse_spool_file(e,"data",file));
+
+    if (e->prev) e->prev->next = e->next; else spool.head = e->next;
+    if (e->next) e->next->prev = e->prev; else spool.tail = e->prev;
+    e->detached = 1;
+    Cthread_cond_broadcast(&spool);
+  }
+  cfuse_spool_release(e);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Write journal of the entry after change of its state: "writing" or
+ *         durable "queued". Journal is written with spool unlocked, so its
+ *         fsync does not block other spool requests. Only one thread writes
+ *         journal of the entry, it writes it again if the state was changed
+ *         meanwhile. Should be called with spool locked. The entry can be
+ *         freed on return if it was removed meanwhile.
+ * @param  e
+ * @return 0 or -errno if journal was not written
+ */
+static int cfuse_spool_journal_update(struct cfuse_spool_entry *e)
+{
+  int res = 0;
+  e->journal_stale = 1;
+  if (e->journaling) return 0;
+  e->journaling = 1;
+  while (e->journal_stale && !e->detached) {
+    struct cfuse_spool_entry copy = *e;
+    int writing = (CFUSE_SPOOL_WRITING == copy.state);
+    e->journal_stale = 0;
+    Cthread_mutex_unlock(&spool);
+    res = cfuse_spool_journal(&copy,writing ? "writing" : "queued",!writing);
+    Cthread_mutex_lock(&spool);
+  }
+  e->journaling = 0;
+  if (e->detached) {
+    /* Removed meanwhile: the journal could be renamed after cfuse_spool_remove */
+    char journal[PATH_SIZE_MAX];
+    unlink(cfuse_spool_file(e,"journal",journal));
+    cfuse_spool_release(e);
+    return 0;
+  }
+  if (0 != res) DEBUG("cfuse_spool_journal_update: %s: %s\n",e->path,strerror(-res));
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Queue entry for upload. Should be called with spool locked. The entry
+ *         can be freed on return if it was removed meanwhile.
+ * @param  e
+ * @return 0 or -errno if journal was not written
+ */
+static int cfuse_spool_queue(struct cfuse_spool_entry *e)
+{
+  e->state = CFUSE_SPOOL_QUEUED;
+  e->retries = 0;
+  e->next_try = 0;
+  e->failed = 0;
+  e->seq = ++spool.queued_seq;
+  Cthread_cond_broadcast(&spool);
+  return cfuse_spool_journal_update(e);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Data of the open entry was changed after it was queued by fsync: it
+ *         is queued again after the last close. Entry being uploaded is marked
+ *         and changed by the uploader. Should be called with spool locked.
+ * @param  e
+ */
+static void cfuse_spool_modify(struct cfuse_spool_entry *e)
+{
+  if (e->detached || CFUSE_SPOOL_WRITING == e->state) return;
+  if (CFUSE_SPOOL_UPLOADING == e->state) {
+    e->modified = 1;
+    return;
+  }
+  e->state = CFUSE_SPOOL_WRITING;
+  cfuse_spool_journal_update(e);
+}
+/* ---------------------------------------------------------------------------------- */
+
+static char* cfuse_parent_path(const char *relative_path, char *result)
+{
+  strncpy(result,relative_path,PATH_SIZE_MAX-1);
+  result[PATH_SIZE_MAX-1] = '\0';
+  char *slash = strrchr(result,'/');
+  if (slash == result) slash++;
+  if (slash) *slash = '\0';
+  return result;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Remember failed upload of the entry for its writer. Should be called
+ *         with spool locked.
+ * @param  e
+ * @param  error
+ */
+static void cfuse_spool_error_put(const struct cfuse_spool_entry *e, int error)
+{
+  /* Recovered after restart: the writer is gone */
+  if (0 == e->pid) return;
+  time_t now = time(NULL);
+  struct cfuse_spool_error *free_error = NULL, *oldest = NULL;
+  int i=0;
+  for (i=0; i < SPOOL_ERRORS_MAX; i++) {
+    struct cfuse_spool_error *se = &spool.errors[i];
+    /* Writer exited or did not look for it for a long time */
+    if (se->error && (se->time + SPOOL_ERROR_TTL < now
+                      || (-1 == kill(se->pid,0) && ESRCH == errno))) se->error = 0;
+    /* The first error is kept */
+    if (se->error && se->uid == e->uid && se->pid == e->pid) return;
+    if (0 == se->error && NULL == free_error) free_error = se;
+    if (se->error && (NULL == oldest || se->time < oldest->time)) oldest = se;
+  }
+  if (NULL == free_error) {
+    DEBUG("cfuse_spool_error_put: too many failed writers, error of pid %d dropped\n",
+                                                                              oldest->pid);
+    free_error = oldest;
+  }
+  free_error->uid = e->uid;
+  free_error->pid = e->pid;
+  free_error->error = error;
+  free_error->time = now;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Take (and forget) failed upload of a file written by the process
+ *         which opened the handle. Read-only handles get nothing.
+ * @param  h
+ * @return errno value or 0
+ */
+static int cfuse_spool_error_take(const struct cfuse_handle *h)
+{
+  int i=0, error=0;
+  if (!h->written) return 0;
+  Cthread_mutex_lock(&spool);
+  for (i=0; i < SPOOL_ERRORS_MAX; i++) {
+    struct cfuse_spool_error *se = &spool.errors[i];
+    if (se->error && se->uid == h->uid && se->pid == h->pid) {
+      error = se->error;
+      se->error = 0;
+      break;
+    }
+  }
+  Cthread_mutex_unlock(&spool);
+  return error;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Upload of the entry failed after all retries. It is still retried
+ *         with the maximum delay. Journal stays "queued": failed files are
+ *         uploaded again after restart too. Should be called with spool locked.
+ * @param  e
+ * @param  error
+ */
+static void cfuse_spool_fail(struct cfuse_spool_entry *e, int error)
+{
+  DEBUG("cfuse_spool_fail: %s: %s\n",e->path,strerror(error));
+  e->state = CFUSE_SPOOL_FAILED;
+  e->error = error;
+  e->next_try = time(NULL) + SPOOL_RETRY_DELAY_MAX;
+  if (!e->failed) {
+    e->failed = 1;
+    cfuse_spool_error_put(e,error);
+  }
+  Cthread_cond_broadcast(&spool);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Open spool data file of the entry for the handle
+ * @param  relative_path
+ * @param  e
+ * @param  flags open flags
+ * @param  fi
+ * @return 0 or -errno
+ */
+static int cfuse_spool_open_handle(const char *relative_path, struct cfuse_spool_entry *e,
+                                   int flags, struct fuse_file_info *fi)
+{
+  char data[PATH_SIZE_MAX];
+  int fd = open(cfuse_spool_file(e,"data",data),flags,0600);
+  if (-1 == fd) return -errno;
+  struct cfuse_handle *h = cfuse_handle_new(relative_path,fd);
+  if (NULL == h) {
+    close(fd);
+    return -ENOMEM;
+  }
+  h->spool = e;
+  e->opened++;
+  fi->fh = (uintptr_t)h;
+  return 0;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Local checks of new name in ingest mode
+ * @param  relative_path
+ * @return 0 or -errno
+ */
+static int cfuse_spool_validate(const char *relative_path)
+{
+  const char *name = strrchr(relative_path,'/');
+  if (strlen(castorfs.root)+strlen(relative_path) >= PATH_SIZE_MAX
+      || (name && strlen(name+1) > CA_MAXNAMELEN)) return -ENAMETOOLONG;
+  return 0;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Create directory in ingest mode. It is queued at once and created in
+ *         CASTOR by uploader before the files inside of it.
+ * @param  relative_path
+ * @param  mode
+ * @return 0 or -errno
+ */
+static int cfuse_spool_mkdir(const char *relative_path, mode_t mode)
+{
+  int res = cfuse_spool_validate(relative_path);
+  if (0 != res) return res;
+
+  uid_t uid = fuse_get_context()->uid;
+  gid_t gid = fuse_get_context()->gid;
+
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  if (e) {
+    res = -EEXIST;
+  } else {
+    e = cfuse_spool_add(spool.next_id++,relative_path,S_IFDIR | (mode & 07777),uid,gid);
+    res = e ? cfuse_spool_queue(e) : -ENOMEM;
+    if (0 != res && e) cfuse_spool_remove(e);
+  }
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Create file in spool. The file is registered in the name server now
+ *         and uploaded to CASTOR after it is closed.
+ * @param  relative_path
+ * @param  mode
+ * @param  fi
+ * @return 0 or -errno
+ */
+static int cfuse_spool_create(const char *relative_path, mode_t mode,
+                                                            struct fuse_file_info *fi)
+{
+  char path[PATH_SIZE_MAX];
+  absolute_path(relative_path,path);
+  if (castorfs.ingest) {
+    /* Only local checks: the file is created in CASTOR by uploader */
+    int res = cfuse_spool_validate(relative_path);
+    if (0 != res) return res;
+  } else if (0 != Cns_creat(path,mode)) {
+    /* Keep the file visible in the namespace while it is in spool */
+    return -rfio_serrno();
+  }
+
+  uid_t uid = fuse_get_context()->uid;
+  gid_t gid = fuse_get_context()->gid;
+
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  /* Previous version was not uploaded yet: it is replaced */
+  if (e) cfuse_spool_remove(e);
+  e = cfuse_spool_add(spool.next_id++,relative_path,mode & 07777,uid,gid);
+  /* The handle keeps the entry while journal is written */
+  int res = e ? cfuse_spool_open_handle(relative_path,e,O_RDWR|O_CREAT|O_TRUNC,fi) : -ENOMEM;
+  if (0 == res && 0 != (res = cfuse_spool_journal_update(e))) {
+    struct cfuse_handle *h = cfuse_handle_get(fi);
+    close(h->fd);
+    free(h);
+    e->opened--;
+  }
+  if (0 != res && e) cfuse_spool_remove(e);
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Open file which is still in spool
+ * @param  relative_path
+ * @param  fi
+ * @return 0 or -errno, 1 if file is not in spool
+ */
+static int cfuse_spool_open(const char *relative_path, struct fuse_file_info *fi)
+{
+  int res = 1;
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  if (NULL == e) {
+    Cthread_mutex_unlock(&spool);
+    return res;
+  }
+  int write = (O_RDONLY != (fi->flags & O_ACCMODE));
+  if (castorfs.multiuser && fuse_get_context()->uid != e->uid
+      && !(e->mode & (write ? S_IWOTH : S_IROTH))) {
+    res = -EACCES;
+  } else if (!write) {
+    res = cfuse_spool_open_handle(relative_path,e,O_RDONLY,fi);
+  } else if (CFUSE_SPOOL_UPLOADING == e->state) {
+    res = -EBUSY;
+  } else {
+    /* File is written again: it will be queued after the last close */
+    res = cfuse_spool_open_handle(relative_path,e,
+                                  O_RDWR | (fi->flags & (O_TRUNC|O_APPEND)),fi);
+    if (0 == res && CFUSE_SPOOL_WRITING != e->state) {
+      e->state = CFUSE_SPOOL_WRITING;
+      cfuse_spool_journal_update(e);
+    }
+  }
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Write to spool data file of the handle
+ * @param  h
+ * @param  buf
+ * @param  size
+ * @param  offset
+ * @return number of written bytes or -errno
+ */
+static int cfuse_spool_write(struct cfuse_handle *h, const char *buf, size_t size,
+                             off_t offset)
+{
+  int res = pwrite(h->fd,buf,size,offset);
+  if (-1 == res) return -errno;
+  Cthread_mutex_lock(&spool);
+  cfuse_spool_modify(h->spool);
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Upload data written through the handle and wait for the end of the
+ *         upload. The file stays open and can be written again: it is queued
+ *         again after the last close. If it is written meanwhile, data written
+ *         so far is uploaded with the new one.
+ * @param  h
+ * @return 0 or errno of the failed upload
+ */
+static int cfuse_spool_fsync(struct cfuse_handle *h)
+{
+  /* The handle keeps the entry */
+  struct cfuse_spool_entry *e = h->spool;
+  unsigned long seq = 0;
+  Cthread_mutex_lock(&spool);
+  e->pid = h->pid;
+  while (!e->detached && !spool.stop) {
+    if (CFUSE_SPOOL_WRITING == e->state || (CFUSE_SPOOL_FAILED == e->state && 0 == seq)) {
+      cfuse_spool_queue(e);
+      seq = e->seq;
+      continue;
+    }
+    if (CFUSE_SPOOL_UPLOADED == e->state || CFUSE_SPOOL_FAILED == e->state) break;
+    Cthread_cond_wait(&spool);
+  }
+  int error = 0;
+  /* Not uploaded yet only if the spool was stopped meanwhile */
+  if (!e->detached && CFUSE_SPOOL_FAILED == e->state) error = e->error;
+  else if (!e->detached && CFUSE_SPOOL_UPLOADED != e->state) error = EIO;
+  Cthread_mutex_unlock(&spool);
+  return error;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Close spool handle. Written file is queued for upload after the last
+ *         close, file uploaded by fsync is removed from spool.
+ * @param  h
+ * @return 0 or -errno
+ */
+static int cfuse_spool_close(struct cfuse_handle *h)
+{
+  int res = 0;
+  if (h->written && 0 != fsync(h->fd)) res = -errno;
+  if (0 != close(h->fd) && 0 == res) res = -errno;
+  if (0 == res && h->error) res = -h->error;
+
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = h->spool;
+  if (h->written) e->pid = h->pid;
+  e->opened--;
+  if (e->detached) cfuse_spool_release(e);
+  else if (0 == e->opened && CFUSE_SPOOL_WRITING == e->state) cfuse_spool_queue(e);
+  /* Uploaded by fsync and not written since */
+  else if (0 == e->opened && CFUSE_SPOOL_UPLOADED == e->state) cfuse_spool_remove(e);
+  Cthread_mutex_unlock(&spool);
+
+  free(h);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Truncate file which is still in spool
+ * @param  relative_path
+ * @param  size
+ * @return 0 or -errno, 1 if file is not in spool
+ */
+static int cfuse_spool_truncate(const char *relative_path, off_t size)
+{
+  int res = 1;
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  if (e && CFUSE_SPOOL_UPLOADING == e->state) {
+    res = -EBUSY;
+  } else if (e) {
+    char data[PATH_SIZE_MAX];
+    res = truncate(cfuse_spool_file(e,"data",data),size) ? -errno : 0;
+    if (0 == res && 0 == e->opened) cfuse_spool_queue(e);
+    else if (0 == res) cfuse_spool_modify(e);
+  }
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Attributes of the file which is still in spool
+ * @param  relative_path
+ * @param  stbuf
+ * @return 0 or -errno, 1 if file is not in spool
+ */
+static int cfuse_spool_getattr(const char *relative_path, struct stat *stbuf)
+{
+  int res = 1;
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  if (e && S_ISDIR(e->mode)) {
+    res = 0;
+    stbuf->st_mode = e->mode;
+    stbuf->st_nlink = 2;
+    stbuf->st_uid = castorfs.multiuser ? e->uid : getuid();
+    stbuf->st_gid = castorfs.multiuser ? e->gid : getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+  } else if (e) {
+    char data[PATH_SIZE_MAX];
+    res = stat(cfuse_spool_file(e,"data",data),stbuf) ? -errno : 0;
+    stbuf->st_mode = S_IFREG | e->mode;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = castorfs.multiuser ? e->uid : getuid();
+    stbuf->st_gid = castorfs.multiuser ? e->gid : getgid();
+  }
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Spool state of the file for XATTR_STATUS
+ * @param  relative_path
+ * @return state name or NULL if file is not in spool
+ */
+static const char* cfuse_spool_status(const char *relative_path)
+{
+  const char *status = NULL;
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  if (e) status = spool_state_names[e->state];
+  Cthread_mutex_unlock(&spool);
+  return status;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Remove file or directory from spool before unlink or rmdir
+ * @param  relative_path
+ * @return 1 if removed, 0 if not in spool, -EBUSY if file is being uploaded,
+ *         -ENOTEMPTY if directory has files in spool
+ */
+static int cfuse_spool_unlink(const char *relative_path)
+{
+  int res = 0;
+  Cthread_mutex_lock(&spool);
+  struct cfuse_spool_entry *e = cfuse_spool_find(relative_path);
+  if (e && (CFUSE_SPOOL_UPLOADING == e->state
+            || (e->opened && CFUSE_SPOOL_UPLOADED != e->state))) res = -EBUSY;
+  if (e && 0 == res && S_ISDIR(e->mode)) {
+    char parent[PATH_SIZE_MAX];
+    struct cfuse_spool_entry *child = spool.head;
+    for (; child && 0 == res; child = child->next) {
+      if (0 == strcmp(cfuse_parent_path(child->path,parent),relative_path)) res = -ENOTEMPTY;
+    }
+  }
+  if (e && 0 == res) {
+    cfuse_spool_remove(e);
+    res = 1;
+  }
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  List files and directories of the directory which are in spool
+ * @param  relative_path
+ * @param  buf
+ * @param  filler
+ * @return 1 if directory itself is in spool, 0 otherwise
+ */
+static int cfuse_spool_readdir(const char *relative_path, void *buf, fuse_fill_dir_t filler)
+{
+  char parent[PATH_SIZE_MAX];
+  Cthread_mutex_lock(&spool);
+  int res = (NULL != cfuse_spool_find(relative_path));
+  struct cfuse_spool_entry *e = spool.head;
+  for (; e; e = e->next) {
+    if (0 != strcmp(cfuse_parent_path(e->path,parent),relative_path)) continue;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_ISDIR(e->mode) ? e->mode : S_IFREG | e->mode;
+    if (filler(buf, strrchr(e->path,'/')+1, &st, 0)) break;
+  }
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Check if file is in spool
+ * @param  relative_path
+ * @return 1 or 0
+ */
+static int cfuse_spool_contains(const char *relative_path)
+{
+  Cthread_mutex_lock(&spool);
+  int res = (NULL != cfuse_spool_find(relative_path));
+  Cthread_mutex_unlock(&spool);
+  return res;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Copy spool data file to CASTOR
+ * @param  e
+ * @return 0 or errno
+ */
+static int cfuse_spool_upload(const struct cfuse_spool_entry *e)
+{
+  char data[PATH_SIZE_MAX], path[PATH_SIZE_MAX];
+  if (S_ISDIR(e->mode)) {
+    absolute_path(e->path,path);
+    if (0 == rfio_mkdir(path,e->mode & 07777) || EEXIST == rfio_serrno()) return 0;
+    return rfio_serrno();
+  }
+
+  int in = open(cfuse_spool_file(e,"data",data),O_RDONLY);
+  if (-1 == in) return errno;
+
+  absolute_path(e->path,path);
+  int out = rfio_open64(path,O_WRONLY|O_CREAT|O_TRUNC,e->mode);
+  if (-1 == out) {
+    int error = rfio_serrno();
+    close(in);
+    return error;
+  }
+
+  int error = 0;
+  char *buf = (char*)malloc(SPOOL_BUFFER_SIZE);
+  if (NULL == buf) error = ENOMEM;
+  while (0 == error) {
+    ssize_t len = read(in,buf,SPOOL_BUFFER_SIZE);
+    if (0 == len) break;
+    if (0 > len) error = errno;
+    else if (len != rfio_write(out,buf,len)) error = rfio_serrno();
+  }
+  free(buf);
+  close(in);
+  if (0 != rfio_close(out) && 0 == error) error = rfio_serrno();
+  return error;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Next entry to upload: queued or failed, retry time passed, parent
+ *         directory is already created and no other version of the file is
+ *         being uploaded. Should be called with spool locked.
+ * @return entry or NULL
+ */
+static struct cfuse_spool_entry* cfuse_spool_next()
+{
+  time_t now = time(NULL);
+  char parent_path[PATH_SIZE_MAX];
+  struct cfuse_spool_entry *e = spool.head;
+  for (; e; e = e->next) {
+    if (CFUSE_SPOOL_QUEUED != e->state && CFUSE_SPOOL_FAILED != e->state) continue;
+    if (e->next_try > now) continue;
+    struct cfuse_spool_entry *parent = cfuse_spool_find(cfuse_parent_path(e->path,
+                                                                       parent_path));
+    if (parent && S_ISDIR(parent->mode)) {
+      /* Retried with the directory */
+      if (CFUSE_SPOOL_FAILED == parent->state && CFUSE_SPOOL_QUEUED == e->state)
+        cfuse_spool_fail(e,parent->error);
+      continue;
+    }
+    struct cfuse_spool_entry *other = spool.hash[cfuse_spool_hash(e->path)];
+    for (; other; other = other->hnext) {
+      if (CFUSE_SPOOL_UPLOADING == other->state && 0 == strcmp(other->path,e->path))
+        break;
+    }
+    if (NULL == other) return e;
+  }
+  return NULL;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Background uploader thread
+ */
+static void* cfuse_spool_thread(void *arg)
+{
+  (void)arg;
+  Cthread_mutex_lock(&spool);
+  while (!spool.stop) {
+    struct cfuse_spool_entry *e = cfuse_spool_next();
+    if (NULL == e) {
+      /* Wake up each second for retries */
+      Cthread_cond_timedwait(&spool,1);
+      continue;
+    }
+    e->state = CFUSE_SPOOL_UPLOADING;
+    spool.active++;
+    Cthread_mutex_unlock(&spool);
+
+    int error = cfuse_set_identity(e->uid,e->gid) ? EACCES : cfuse_spool_upload(e);
+
+    Cthread_mutex_lock(&spool);
+    spool.active--;
+    if (e->detached) {
+      /* Removed or created again during upload */
+      e->state = CFUSE_SPOOL_UPLOADED;
+      cfuse_spool_release(e);
+    } else if (e->modified) {
+      /* Written during upload of the file queued by fsync */
+      e->modified = 0;
+      if (0 == e->opened) {
+        cfuse_spool_queue(e);
+      } else {
+        e->state = CFUSE_SPOOL_WRITING;
+        cfuse_spool_journal_update(e);
+      }
+    } else if (0 == error) {
+      DEBUG("cfuse_spool_thread: %s uploaded\n",e->path);
+      cfuse_open_cache_invalidate(e->path);
+      e->state = CFUSE_SPOOL_UPLOADED;
+      /* Open file is removed after the last close */
+      if (0 == e->opened) cfuse_spool_remove(e);
+    } else if (++e->retries < castorfs.spool_retries && !e->failed) {
+      DEBUG("cfuse_spool_thread: %s: %s, retry %d\n",e->path,strerror(error),e->retries);
+      e->state = CFUSE_SPOOL_QUEUED;
+      e->next_try = time(NULL) + (1 << e->retries);
+    } else {
+      cfuse_spool_fail(e,error);
+    }
+    Cthread_cond_broadcast(&spool);
+  }
+  Cthread_cond_broadcast(&spool);
+  Cthread_mutex_unlock(&spool);
+  return NULL;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Barrier: wait until all files of the calling user closed before the
+ *         call are uploaded or failed. Files which failed already are not
+ *         waited for while they are retried. State of the spool is not changed.
+ * @return number of files of the user closed before the call which failed and
+ *         are still in spool, 0 if all of them are in CASTOR
+ */
+static int cfuse_spool_wait()
+{
+  uid_t uid = fuse_get_context()->uid;
+  int failed = 0;
+  Cthread_mutex_lock(&spool);
+  unsigned long seq = spool.queued_seq;
+  struct cfuse_spool_entry *e = NULL;
+  for (;;) {
+    for (e = spool.head; e; e = e->next) {
+      if (e->uid != uid || e->seq > seq || e->failed) continue;
+      if (CFUSE_SPOOL_QUEUED == e->state || CFUSE_SPOOL_UPLOADING == e->state) break;
+    }
+    if (NULL == e || spool.stop) break;
+    Cthread_cond_wait(&spool);
+  }
+  /* Not failed ones are left only if the spool was stopped meanwhile */
+  for (e = spool.head; e; e = e->next) {
+    if (e->uid != uid || e->seq > seq) continue;
+    if (e->failed || CFUSE_SPOOL_QUEUED == e->state
+        || CFUSE_SPOOL_UPLOADING == e->state) failed++;
+  }
+  Cthread_mutex_unlock(&spool);
+  return failed;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Barrier for XATTR_SPOOL_SYNC
+ * @param  value Result: "ok" or "failed <number of failed files>"
+ * @param  size
+ * @return length of the result
+ */
+static int cfuse_spool_sync(char *value, size_t size)
+{
+  int failed = cfuse_spool_wait();
+  if (failed) snprintf(value,size,"failed %d",failed);
+  else snprintf(value,size,"ok");
+  return strlen(value);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Load journal of the entry left by previous run
+ * @param  journal
+ * @param  id
+ */
+static void cfuse_spool_recover(const char *journal, unsigned long id)
+{
+  char state[16], relative_path[PATH_SIZE_MAX];
+  unsigned int mode;
+  int uid, gid;
+  FILE *f = fopen(journal,"r");
+  if (NULL == f) return;
+  int n = fscanf(f,"%15s %o %d %d ",state,&mode,&uid,&gid);
+  if (4 != n || NULL == fgets(relative_path,PATH_SIZE_MAX,f)) {
+    fclose(f);
+    DEBUG("cfuse_spool_recover: bad journal %s\n",journal);
+    return;
+  }
+  fclose(f);
+  relative_path[strcspn(relative_path,"\n")] = '\0';
+
+  if (0 == strcmp(state,"writing")) {
+    /* File was not closed by application before crash: it can be incomplete.
+     * Data is kept for the administrator, the file is not shadowed. */
+    char data[PATH_SIZE_MAX], incomplete[PATH_SIZE_MAX];
+    snprintf(data,PATH_SIZE_MAX,"%s/%lu.data",castorfs.spool,id);
+    snprintf(incomplete,PATH_SIZE_MAX,"%s/%lu.incomplete",castorfs.spool,id);
+    rename(data,incomplete);
+    unlink(journal);
+    DEBUG("cfuse_spool_recover: %s incomplete, kept in %s\n",relative_path,incomplete);
+    return;
+  }
+  /* Queued and failed files are uploaded again */
+  struct cfuse_spool_entry *e = cfuse_spool_add(id,relative_path,mode,uid,gid);
+  if (NULL == e) return;
+  cfuse_spool_queue(e);
+  DEBUG("cfuse_spool_recover: %s %s\n",relative_path,state);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Resume uploads left by previous run and start uploader threads
+ * @return 0 or -errno if spool directory can not be read
+ */
+static int cfuse_spool_start()
+{
+  if (NULL == castorfs.spool) return 0;
+  DIR *dir = opendir(castorfs.spool);
+  if (NULL == dir) return -errno;
+  struct dirent *de;
+  char file[PATH_SIZE_MAX];
+  Cthread_mutex_lock(&spool);
+  spool.next_id = 1;
+  /* Journals first. Ids of all files are skipped, <id>.incomplete included,
+   * so new files never take them. */
+  while (NULL != (de = readdir(dir))) {
+    char *suffix = NULL;
+    unsigned long id = strtoul(de->d_name,&suffix,10);
+    if (suffix == de->d_name) continue;
+    if (id >= spool.next_id) spool.next_id = id+1;
+    if (0 != strcmp(suffix,".journal")) continue;
+    snprintf(file,PATH_SIZE_MAX,"%s/%s",castorfs.spool,de->d_name);
+    cfuse_spool_recover(file,id);
+  }
+  /* Data without journal and temporary journals */
+  rewinddir(dir);
+  while (NULL != (de = readdir(dir))) {
+    char *suffix = NULL;
+    unsigned long id = strtoul(de->d_name,&suffix,10);
+    if (suffix == de->d_name || 0 == strcmp(suffix,".journal")
+        || 0 == strcmp(suffix,".incomplete")) continue;
+    snprintf(file,PATH_SIZE_MAX,"%s/%lu.journal",castorfs.spool,id);
+    if (0 == strcmp(suffix,".data") && 0 == access(file,F_OK)) continue;
+    snprintf(file,PATH_SIZE_MAX,"%s/%s",castorfs.spool,de->d_name);
+    unlink(file);
+  }
+  closedir(dir);
+  Cthread_mutex_unlock(&spool);
+
+  int i=0;
+  for (i=0; i < castorfs.spool_uploaders; i++) {
+    if (0 > Cthread_create_detached(cfuse_spool_thread,NULL)) {
+      DEBUG("main.c: could not start spool thread %d\n",i);
+    }
+  }
+  spool.running = 1;
+  return 0;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Stop uploader threads. Uploads in progress are finished, queued files
+ *         stay in spool and are uploaded after the next mount.
  */
-static char* absolute_path(const char* relative_path,char *result)
+static void cfuse_spool_stop()
 {
-   int size = strlen(castorfs.root)+strlen(relative_path)+1;
-   //char* result = (char*)calloc(sizeof(char),size);
-   strncpy(result,castorfs.root,PATH_SIZE_MAX);
-   return strncat(result,relative_path,PATH_SIZE_MAX);
+  if (!spool.running) return;
+  Cthread_mutex_lock(&spool);
+  spool.stop = 1;
+  Cthread_cond_broadcast(&spool);
+  while (spool.active > 0) Cthread_cond_wait(&spool);
+  Cthread_mutex_unlock(&spool);
 }
 /* ---------------------------------------------------------------------------------- */
 
-static int cfuse_getsegattrs(const char* relative_path,int *nbseg, 
-                                                          struct Cns_segattrs **xattrs)
+/**
+ * @brief  Read from CASTOR file. Should be called with handle locked, because
+ *         position of RFIO file is shared.
+ * @return number of read bytes or -errno
+ */
+static int cfuse_read_at(struct cfuse_handle *h, char *buf, size_t size, off_t offset)
 {
-  char path[PATH_SIZE_MAX];
-  absolute_path(relative_path,path);
-  int res = Cns_getsegattrs(path,NULL,nbseg,xattrs);
+  int res = -1;
+  if (-1 != rfio_lseek64(h->fd,offset,SEEK_SET)) res = rfio_read(h->fd,buf,size);
+  if (-1 == res) {
+    DEBUG("cfuse_read: %s",rfio_serror());
+    return -rfio_serrno();
+  }
   return res;
 }
 /* ---------------------------------------------------------------------------------- */
 
 /**
- * @brief  Helper function
- *         (1) Add new attribute to attribute list. 
- *         (2) Increment total length of list. 
- *         (3) Change list pointer to the end of list
- * @param  attribute Attribute which sould be added
- * @param  list Target list (inout).
- * @param  len Total length of list (out).
- * @param maxsize Maximum size of added attribute (out)
- * @see cfuse_init_xattrlist
+ * @brief  Prefetch collected reads with one rfio_preseek64 and then serve them
+ *         from the prefetched data. Reads closer than castor_read_gap are merged
+ *         into one range. Should be called with handle locked.
+ * @param  h
+ * @param  reads
+ * @return reads which did not fit into the batch
  */
-static void _cfuse_add_attribute(const char *attribute,char** list, int *len, int *maxsize)
+static struct cfuse_read_request* cfuse_read_batch(struct cfuse_handle *h,
+                                                   struct cfuse_read_request *reads)
 {
-  int l = strlen(attribute);
-  memcpy(*list,attribute,l+1);
-  *list = *list+l+1;
-  maxsize = maxsize-l+1;
-  *len += l+1;
+  struct cfuse_read_request *sorted[READ_BATCH_MAX];
+  struct iovec64 iov[READ_BATCH_MAX];
+  int n=0, niov=0, i=0;
+
+  /* Sort by offset */
+  for (; reads && n < READ_BATCH_MAX; reads = reads->next) {
+    for (i=n; i > 0 && sorted[i-1]->offset > reads->offset; i--) sorted[i] = sorted[i-1];
+    sorted[i] = reads;
+    n++;
+  }
+
+  for (i=0; i < n; i++) {
+    off_t end = sorted[i]->offset + sorted[i]->size;
+    if (niov > 0 && sorted[i]->offset <= iov[niov-1].iov_base+iov[niov-1].iov_len
+                                                                + castorfs.read_gap) {
+      if (end > iov[niov-1].iov_base+iov[niov-1].iov_len)
+        iov[niov-1].iov_len = end - iov[niov-1].iov_base;
+    } else {
+      iov[niov].iov_base = sorted[i]->offset;
+      iov[niov].iov_len = sorted[i]->size;
+      niov++;
+    }
+  }
+  if (n > 1 && -1 == rfio_preseek64(h->fd,iov,niov))
+    DEBUG("cfuse_read_batch: %s",rfio_serror());
+
+  for (i=0; i < n; i++) {
+    sorted[i]->result = cfuse_read_at(h,sorted[i]->buf,sorted[i]->size,sorted[i]->offset);
+    sorted[i]->done = 1;
+  }
+  return reads;
 }
 /* ---------------------------------------------------------------------------------- */
 
 /**
- * @brief  Init full list of available attributes.
- *         When it will be called cfuse_listxattr the list will be reduced 
+ * @brief  Check if read of CASTOR file is collected with other reads
+ * @param  size
+ * @return 1 or 0
  */
-static void cfuse_init_xattrlist()
+static int cfuse_read_is_small(size_t size)
 {
-   char *current = xattrlist;
-   int max = XATTR_LIST_SIZE_MAX;
-   int len = 0;
-   _cfuse_add_attribute(XATTR_STATUS,&current,&xattrlist_len,&max);
-   _cfuse_add_attribute(XATTR_NBSEG,&current,&xattrlist_len,&max);
-   _cfuse_add_attribute(XATTR_CHECKSUM_NAME,&current,&xattrlist_len,&max);
-   _cfuse_add_attribute(XATTR_CHECKSUM,&current,&xattrlist_len,&max);
-   
-   xattrlist_segment_sum_len = strlen(XATTR_CHECKSUM_NAME)+strlen(XATTR_CHECKSUM)+2;
+  return 0 < castorfs.read_window && size <= (size_t)castorfs.read_small;
+}
+/* ---------------------------------------------------------------------------------- */
 
-   int i=1;
-   for (i=1; i <= XATTR_NUM_SEGMENTS_MAX; i++) {
-     char name[XATTR_NAME_SIZE_MAX];
-     snprintf(name,XATTR_NAME_SIZE_MAX,"castor.seg%d.checksum_name",i);
-     if ( i==1 ) xattrlist_segment_len += strlen(name)+1;
-     _cfuse_add_attribute(name,&current,&xattrlist_len,&max);
-     snprintf(name,XATTR_NAME_SIZE_MAX,"castor.seg%d.checksum",i);
-     if ( i==1 ) xattrlist_segment_len += strlen(name)+1;
-     _cfuse_add_attribute(name,&current,&xattrlist_len,&max);
-   }
+/**
+ * @brief  Small read which can be sent together with other reads of the handle.
+ *         The first thread waits castor_read_window microseconds for the others
+ *         and then reads for all of them in one data slot of the scheduler.
+ *         The others wait without a slot.
+ * @return number of read bytes or -errno
+ */
+static int cfuse_read_batched(struct cfuse_handle *h, char *buf, size_t size, off_t offset)
+{
+  struct cfuse_read_request request = {offset, size, buf, 0, 0, NULL};
+
+  Cthread_mutex_lock(h);
+  request.next = h->reads;
+  h->reads = &request;
+  if (h->reading) {
+    while (!request.done) Cthread_cond_wait(h);
+    Cthread_mutex_unlock(h);
+    return request.result;
+  }
+  h->reading = 1;
+  Cthread_mutex_unlock(h);
+
+  usleep(castorfs.read_window);
+
+  /* Reads coming while the slot is awaited join the batch */
+  struct cfuse_sched_ticket ticket;
+  cfuse_sched_enter(&ticket,CFUSE_SCHED_DATA);
+  Cthread_mutex_lock(h);
+  while (h->reads) h->reads = cfuse_read_batch(h,h->reads);
+  h->reading = 0;
+  Cthread_cond_broadcast(h);
+  Cthread_mutex_unlock(h);
+  cfuse_sched_leave(&ticket);
+  return request.result;
 }
 /* ---------------------------------------------------------------------------------- */
-static int cfuse_cns_stat(const char *relative_path, struct Cns_filestat *stat)
+
+static long cfuse_elapsed_us(const struct timeval *from, const struct timeval *to)
 {
-  char path[PATH_SIZE_MAX];
-  absolute_path(relative_path,path);
-  int res = Cns_lstat(path,stat);
-  return res;
+  return (to->tv_sec-from->tv_sec)*1000000L + (to->tv_usec-from->tv_usec);
 }
 /* ---------------------------------------------------------------------------------- */
 
-static void cfuse_free_segattrs(struct Cns_segattrs **attrs,int size)
+/**
+ * @brief  Find scheduler client for uid. Should be called with sched locked.
+ * @param  uid
+ * @return 
+ */
+static struct cfuse_sched_client* cfuse_sched_client_get(uid_t uid)
 {
+  struct cfuse_sched_client *free_client = NULL;
   int i=0;
-  for (i=0;i++;i<size) {
-    struct Cns_segattrs *current = *attrs+i*sizeof(struct Cns_segattrs);
-    free(current);
+  for (i=0; i < SCHED_CLIENTS_MAX; i++) {
+    struct cfuse_sched_client *c = &sched.clients[i];
+    if (c->uid == uid && (c->running || c->waiting || c->refill.tv_sec)) return c;
+    if (NULL == free_client && 0 == c->running && 0 == c->waiting) free_client = c;
   }
-  free(*attrs);
+  /* Too many active clients: the last one is shared by the rest */
+  if (NULL == free_client) return &sched.clients[SCHED_CLIENTS_MAX-1];
+
+  memset(free_client,0,sizeof(struct cfuse_sched_client));
+  free_client->uid = uid;
+  free_client->tokens = castorfs.ns_rate;
+  gettimeofday(&free_client->refill,NULL);
+  return free_client;
 }
 /* ---------------------------------------------------------------------------------- */
-int cfuse_init_account_fuse()
-{
-  struct group fuse_group, *pfuse_group=NULL;
-  int bufsize = sysconf(_SC_GETGR_R_SIZE_MAX);
-  char *buf;
 
-  buf = malloc(bufsize);
-  getgrnam_r("fuse",&fuse_group,buf,bufsize,&pfuse_group);
-  if (!pfuse_group) {
-      DEBUG("main.c: Can not find group %s","fuse");
-      free(buf);
-      return -1;
-  }
-  if (-1 == setgroups(1,&fuse_group.gr_gid)){
-    DEBUG("main.c: Can not set fuse group for current proccess gid=%d",fuse_group.gr_gid);
-    free(buf);
-    return -1;
+/**
+ * @brief  Find process of the client. Should be called with sched locked.
+ * @param  c
+ * @param  pid
+ * @return 
+ */
+static struct cfuse_sched_process* cfuse_sched_process_get(struct cfuse_sched_client *c,
+                                                           pid_t pid)
+{
+  struct cfuse_sched_process *free_process = NULL;
+  int i=0;
+  for (i=0; i < SCHED_PROCESSES_MAX; i++) {
+    struct cfuse_sched_process *p = &c->processes[i];
+    if (p->pid == pid && (p->running || p->waiting)) return p;
+    if (NULL == free_process && 0 == p->running && 0 == p->waiting) free_process = p;
   }
-  free(buf);
+  /* Too many active processes: the last one is shared by the rest */
+  if (NULL == free_process) return &c->processes[SCHED_PROCESSES_MAX-1];
+  free_process->pid = pid;
+  free_process->granted = 0;
+  return free_process;
 }
 /* ---------------------------------------------------------------------------------- */
-int cfuse_init_account()
+
+/**
+ * @brief  Order of processes of one client in the scheduler
+ * @param  a
+ * @param  b
+ * @return 1 if request of a should go before request of b
+ */
+static int cfuse_sched_process_before(const struct cfuse_sched_process *a,
+                                      const struct cfuse_sched_process *b)
 {
-  int res=0;
-  if ( 0 != castorfs.gid ) {
-    res = setgid(castorfs.gid);
-    if ( -1 == res){
-      DEBUG("main.c: could not setup uid to %d\n",castorfs.uid);
-      return -1;
+  if (a->running != b->running) return a->running < b->running;
+  return a->granted < b->granted;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Wait until client is allowed to make one more name server request
+ * @param  uid
+ */
+static void cfuse_sched_throttle(uid_t uid)
+{
+  for (;;) {
+    Cthread_mutex_lock(&sched);
+    struct cfuse_sched_client *c = cfuse_sched_client_get(uid);
+    struct timeval now;
+    gettimeofday(&now,NULL);
+    c->tokens += cfuse_elapsed_us(&c->refill,&now) * castorfs.ns_rate / 1e6;
+    if (c->tokens > castorfs.ns_rate) c->tokens = castorfs.ns_rate;
+    c->refill = now;
+    if (c->tokens >= 1) {
+      c->tokens -= 1;
+      Cthread_mutex_unlock(&sched);
+      return;
     }
+    useconds_t delay = (1 - c->tokens) * 1e6 / castorfs.ns_rate;
+    Cthread_mutex_unlock(&sched);
+    usleep(delay+1);
+  }
+}
+/* ---------------------------------------------------------------------------------- */
 
-    /* Add also fuse group */
-    cfuse_init_account_fuse();
+/**
+ * @brief  Maximum number of data requests which one client may run now. While
+ *         data requests of several clients wait, it is a fair share of data
+ *         slots between clients with data requests, but not more than
+ *         castor_sched_user_slots. So a client which waits for long tape
+ *         recalls never takes all slots from the others. Without competition
+ *         a client may use all data slots. Should be called with sched locked.
+ * @param  data_slots
+ * @return 
+ */
+static int cfuse_sched_data_limit(int data_slots)
+{
+  int active = 0, waiting = 0, i = 0;
+  for (i=0; i < SCHED_CLIENTS_MAX; i++) {
+    struct cfuse_sched_client *c = &sched.clients[i];
+    if (c->data_running || c->data_waiting) active++;
+    if (c->data_waiting) waiting++;
   }
-  if ( 0 != castorfs.uid) {
-    res = setuid(castorfs.uid);
-    if ( -1 == res){
-      DEBUG("main.c: could not setup gid to %d\n",castorfs.gid);
-      return -1;
+  /* Waiting requests of one client only: nobody to share with */
+  if (waiting < 2) return data_slots;
+  int limit = data_slots / active;
+  if (limit > castorfs.sched_user_slots) limit = castorfs.sched_user_slots;
+  return limit > 1 ? limit : 1;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Give free slots to waiting requests. Metadata requests go first and
+ *         one slot is kept for them. Inside of class the client with the least
+ *         number of running requests goes first, inside of client the process
+ *         with the least number of running requests and then the one which
+ *         waits longest since its last request. Should be called with sched
+ *         locked.
+ */
+static void cfuse_sched_dispatch()
+{
+  int data_slots = castorfs.sched_slots-1;
+  while (sched.running < castorfs.sched_slots) {
+    int data_limit = cfuse_sched_data_limit(data_slots);
+    struct cfuse_sched_ticket *best = NULL, **best_prev = NULL, **prev = NULL;
+    enum cfuse_sched_class cls = CFUSE_SCHED_META;
+    for (cls=CFUSE_SCHED_META; cls < CFUSE_SCHED_CLASSES && NULL == best; cls++) {
+      if (CFUSE_SCHED_DATA == cls && sched.stats[cls].running >= data_slots) break;
+      for (prev = &sched.waiting; *prev; prev = &(*prev)->next) {
+        struct cfuse_sched_ticket *t = *prev;
+        if (t->cls != cls) continue;
+        if (CFUSE_SCHED_DATA == cls && t->client->data_running >= data_limit) continue;
+        if (NULL == best || t->client->running < best->client->running
+            || (t->client == best->client
+                && cfuse_sched_process_before(t->process,best->process))) {
+          best = t;
+          best_prev = prev;
+        }
+      }
     }
+    if (NULL == best) return;
+
+    *best_prev = best->next;
+    best->granted = 1;
+    best->client->waiting--;
+    best->client->running++;
+    best->process->waiting--;
+    best->process->running++;
+    best->process->granted = ++sched.granted;
+    if (CFUSE_SCHED_DATA == best->cls) {
+      best->client->data_waiting--;
+      best->client->data_running++;
+    }
+    sched.running++;
+
+    struct cfuse_sched_stats *stats = &sched.stats[best->cls];
+    struct timeval now;
+    gettimeofday(&now,NULL);
+    long elapsed = cfuse_elapsed_us(&best->queued,&now);
+    unsigned long wait = elapsed > 0 ? elapsed : 0;
+    stats->waiting--;
+    stats->running++;
+    stats->requests++;
+    stats->wait_us += wait;
+    if (wait > stats->max_wait_us) stats->max_wait_us = wait;
+    Cthread_cond_broadcast(&sched);
   }
-  return 0;
 }
 /* ---------------------------------------------------------------------------------- */
 
-void cfuse_debug_account()
+/**
+ * @brief  Wait for the scheduler slot for the request of the user process
+ * @param  ticket
+ * @param  cls
+ * @param  uid
+ * @param  pid
+ */
+static void cfuse_sched_enter_as(struct cfuse_sched_ticket *ticket,
+                                 enum cfuse_sched_class cls, uid_t uid, pid_t pid)
 {
-   DEBUG("uid=%d,gid=%d,euid=%d,egid=%d",getuid(),getgid(),geteuid(),getegid());
+  if (0 >= castorfs.sched_slots) return;
+  if (CFUSE_SCHED_META == cls && 0 < castorfs.ns_rate) cfuse_sched_throttle(uid);
+
+  Cthread_mutex_lock(&sched);
+  ticket->cls = cls;
+  ticket->client = cfuse_sched_client_get(uid);
+  ticket->process = cfuse_sched_process_get(ticket->client,pid);
+  ticket->granted = 0;
+  ticket->next = NULL;
+  gettimeofday(&ticket->queued,NULL);
+
+  struct cfuse_sched_ticket **last = &sched.waiting;
+  while (*last) last = &(*last)->next;
+  *last = ticket;
+  ticket->client->waiting++;
+  ticket->process->waiting++;
+  if (CFUSE_SCHED_DATA == cls) ticket->client->data_waiting++;
+  struct cfuse_sched_stats *stats = &sched.stats[cls];
+  stats->waiting++;
+  if (stats->waiting > stats->max_waiting) stats->max_waiting = stats->waiting;
+
+  cfuse_sched_dispatch();
+  while (!ticket->granted) Cthread_cond_wait(&sched);
+  Cthread_mutex_unlock(&sched);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Wait for the scheduler slot for the current FUSE request
+ * @param  ticket
+ * @param  cls
+ */
+static void cfuse_sched_enter(struct cfuse_sched_ticket *ticket, enum cfuse_sched_class cls)
+{
+  struct fuse_context *context = fuse_get_context();
+  cfuse_sched_enter_as(ticket,cls,context->uid,context->pid);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Release the scheduler slot of the request
+ * @param  ticket
+ */
+static void cfuse_sched_leave(struct cfuse_sched_ticket *ticket)
+{
+  if (0 >= castorfs.sched_slots) return;
+  Cthread_mutex_lock(&sched);
+  ticket->client->running--;
+  ticket->process->running--;
+  if (CFUSE_SCHED_DATA == ticket->cls) ticket->client->data_running--;
+  sched.stats[ticket->cls].running--;
+  sched.running--;
+  cfuse_sched_dispatch();
+  Cthread_mutex_unlock(&sched);
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Print scheduler statistics, one line per class
+ * @param  value
+ * @param  size
+ * @return length of the printed text
+ */
+static int cfuse_sched_print_stats(char *value, size_t size)
+{
+  int len = 0, cls = 0;
+  Cthread_mutex_lock(&sched);
+  for (cls=0; cls < CFUSE_SCHED_CLASSES && len < (int)size; cls++) {
+    struct cfuse_sched_stats *stats = &sched.stats[cls];
+    len += snprintf(value+len,size-len,
+      "%s running=%d queued=%d max_queued=%d requests=%lu wait_avg_us=%llu wait_max_us=%lu\n",
+      sched_class_names[cls],stats->running,stats->waiting,stats->max_waiting,
+      stats->requests,stats->requests ? stats->wait_us/stats->requests : 0,
+      stats->max_wait_us);
+  }
+  Cthread_mutex_unlock(&sched);
+  return len < (int)size ? len : (int)size;
 }
 /* ---------------------------------------------------------------------------------- */
 
@@ -293,7 +2263,12 @@ void cfuse_debug_account()
  */
 static int cfuse_getattr(const char* relative_path, struct stat *stbuf)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   memset(stbuf, 0, sizeof(struct stat));
+  if (castorfs.spool) {
+    int res = cfuse_spool_getattr(relative_path,stbuf);
+    if (1 != res) return res;
+  }
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path,path);
   DEBUG("PATH=%s\n",path);
@@ -322,6 +2297,7 @@ static int cfuse_access(const char* relative_path, int mask)
 /* ---------------------------------------------------------------------------------- */
 static int cfuse_chown(const char *relative_path, uid_t uid, gid_t gid)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   if (castorfs.readonly) return -EACCES;
   
   char path[PATH_SIZE_MAX];
@@ -343,17 +2319,27 @@ static int cfuse_chown(const char *relative_path, uid_t uid, gid_t gid)
 static int cfuse_readdir(const char* relative_path, void *buf, fuse_fill_dir_t filler,
                                               off_t offset, struct fuse_file_info *fi)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
 
   struct Cns_direnstat *de;
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path,path);
+  /* Files in spool first, they are skipped in the name server listing */
+  int spooled = castorfs.spool ? cfuse_spool_readdir(relative_path,buf,filler) : 0;
   Cns_DIR* dp = Cns_opendir(path);
-  if (dp == NULL) return -errno;
+  if (dp == NULL) return spooled ? 0 : -errno;
   while ((de = Cns_readdirx(dp)) != NULL) {
     struct stat st;
     memset(&st, 0, sizeof(st));
     st.st_mode = de->filemode;
 
+    if (castorfs.spool) {
+      char child[PATH_SIZE_MAX];
+      snprintf(child,PATH_SIZE_MAX,"%s/%s",strcmp(relative_path,"/") ? relative_path : "",
+                                                                          de->d_name);
+      if (cfuse_spool_contains(child)) continue;
+    }
+
     if (filler(buf, de->d_name, &st, 0))
       break;
   }
@@ -373,16 +2359,27 @@ static int cfuse_readdir(const char* relative_path, void *buf, fuse_fill_dir_t f
 static int cfuse_create(const char* relative_path, mode_t mode, 
                                                           struct fuse_file_info *fi)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   if (castorfs.readonly) return -EACCES;
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path,path);
+  cfuse_open_cache_invalidate(relative_path);
+  /* Report failed commit of the previous version written by this user */
+  int error = cfuse_deferred_error_take(relative_path);
+  if (error) return -error;
+  if (castorfs.spool) return cfuse_spool_create(relative_path,mode,fi);
   int fd = rfio_open64(path,O_WRONLY|O_CREAT|O_TRUNC /*fi->flags*/,mode);
   if (fd == -1) {
     DEBUG("cfuse_create: %s",rfio_serror());
     return -rfio_serrno();
   }
 
-  fi->fh = fd;
+  struct cfuse_handle *h = cfuse_handle_new(relative_path,fd);
+  if (NULL == h) {
+    rfio_close(fd);
+    return -ENOMEM;
+  }
+  fi->fh = (uintptr_t)h;
   return 0;
 }
 /* ---------------------------------------------------------------------------------- */
@@ -395,12 +2392,38 @@ static int cfuse_create(const char* relative_path, mode_t mode,
  */
 static int cfuse_open(const char* relative_path, struct fuse_file_info *fi)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path,path);
+  /* Report failed commit of the file written by this user */
+  int error = cfuse_deferred_error_take(relative_path);
+  if (error) return -error;
+  if (castorfs.spool) {
+    int res = cfuse_spool_open(relative_path,fi);
+    if (1 != res) return res;
+  }
+
+  /* Kernel drops cached pages on open unless keep_cache is set. Keep them
+   * if the file was not changed since the last open. */
+  int keep_cache = 0;
+  if (O_RDONLY == (fi->flags & O_ACCMODE)) {
+    struct Cns_filestat stat;
+    if (!castorfs.no_keep_cache && 0 == cfuse_cns_stat(relative_path,&stat))
+      keep_cache = cfuse_open_cache_check(relative_path,&stat);
+  } else {
+    cfuse_open_cache_invalidate(relative_path);
+  }
+
   int fd = rfio_open64(path,fi->flags, 0644);
   if (fd == -1) return -rfio_serrno();
 
-  fi->fh = fd;
+  struct cfuse_handle *h = cfuse_handle_new(relative_path,fd);
+  if (NULL == h) {
+    rfio_close(fd);
+    return -ENOMEM;
+  }
+  fi->fh = (uintptr_t)h;
+  fi->keep_cache = keep_cache;
   return 0;
 }
 /* ---------------------------------------------------------------------------------- */
@@ -418,17 +2441,19 @@ static int cfuse_read(const char* relative_path, char *buf, size_t size, off_t o
       struct fuse_file_info *fi)
 {
 
-  int fd;
+  struct cfuse_handle *h = cfuse_handle_get(fi);
   (void)relative_path;
 
-  rfio_lseek64(fi->fh,offset,SEEK_SET);
-
-  int res = rfio_read(fi->fh,buf, size);
-  if (res == -1) {
-    DEBUG("cfuse_read: %s",rfio_serror());
-    return -rfio_serrno();
+  if (h->spool) {
+    int res = pread(h->fd,buf,size,offset);
+    return -1 == res ? -errno : res;
   }
 
+  if (cfuse_read_is_small(size)) return cfuse_read_batched(h,buf,size,offset);
+
+  Cthread_mutex_lock(h);
+  int res = cfuse_read_at(h,buf,size,offset);
+  Cthread_mutex_unlock(h);
   return res;
 }
 /* ---------------------------------------------------------------------------------- */
@@ -447,18 +2472,77 @@ static int cfuse_write(const char* relative_path, const char *buf, size_t size,
 {
   if (castorfs.readonly) return -EACCES;
 
+  struct cfuse_handle *h = cfuse_handle_get(fi);
   (void)relative_path;
 
-  rfio_lseek64(fi->fh,offset,SEEK_SET); 
-  int res = rfio_write(fi->fh,(void*)buf, size);
-  if (res == -1) {
-    DEBUG("cfuse_write: %s",rfio_serror());
-    return -rfio_serrno();
+  int res = 0;
+  if (h->spool) {
+    res = cfuse_spool_write(h,buf,size,offset);
+  } else {
+    Cthread_mutex_lock(h);
+    if (-1 == rfio_lseek64(h->fd,offset,SEEK_SET)) res = -1;
+    if (0 == res) res = rfio_write(h->fd,(void*)buf, size);
+    if (-1 == res) {
+      DEBUG("cfuse_write: %s",rfio_serror());
+      res = -rfio_serrno();
+    }
+    Cthread_mutex_unlock(h);
+  }
+  if (0 > res) {
+    if (0 == h->error) h->error = -res;
+    return res;
   }
+  h->written = 1;
   return res;
 }
 /* ---------------------------------------------------------------------------------- */
 
+/**
+ * @brief  Implementation of FUSE hook "flush". Called on each close(2) of the
+ *         file, reports errors which are known already: write errors which
+ *         were not seen by the application and failed uploads. Written CASTOR
+ *         file is committed by release in background, see cfuse_handle_close.
+ * @param  relative_path
+ * @param  fi
+ * @return 
+ */
+static int cfuse_flush(const char* relative_path, struct fuse_file_info *fi)
+{
+  struct cfuse_handle *h = cfuse_handle_get(fi);
+  (void)relative_path;
+
+  int error = h->error;
+  h->error = 0;
+  /* Failed upload of a file written before by this process */
+  if (0 == error && h->spool) error = cfuse_spool_error_take(h);
+  return -error;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief  Implementation of FUSE hook "fsync". Spooled file written through
+ *         the handle is uploaded and fsync returns the result of its upload.
+ *         For other spooled files waits until files closed before are
+ *         uploaded and reports failed upload of a file written by this
+ *         process. RFIO has no fsync: written data is committed by close.
+ * @param  relative_path
+ * @param  datasync
+ * @param  fi
+ * @return 
+ */
+static int cfuse_fsync(const char* relative_path, int datasync, struct fuse_file_info *fi)
+{
+  struct cfuse_handle *h = cfuse_handle_get(fi);
+  (void)relative_path;
+
+  if (NULL == h->spool) return 0;
+  if (0 != (datasync ? fdatasync(h->fd) : fsync(h->fd))) return -errno;
+  if (h->written) return -cfuse_spool_fsync(h);
+  cfuse_spool_wait();
+  return -cfuse_spool_error_take(h);
+}
+/* ---------------------------------------------------------------------------------- */
+
 /**
  * @brief  Implementation of FUSE hook "release"
  * @param  relative_path
@@ -467,8 +2551,13 @@ static int cfuse_write(const char* relative_path, const char *buf, size_t size,
  */
 static int cfuse_release(const char* relative_path, struct fuse_file_info *fi)
 {
+  struct cfuse_handle *h = cfuse_handle_get(fi);
   (void)relative_path;
-  rfio_close(fi->fh);
+
+  /* Closing of CASTOR file is finished in background: for written file it
+   * is the commit on the disk server. Release waits if the queue is full.
+   * Spool files are local and closed here. */
+  if (h->spool || 0 != cfuse_close_queue_put(h)) cfuse_handle_close(h);
 
   return 0;
 }
@@ -481,11 +2570,17 @@ static int cfuse_release(const char* relative_path, struct fuse_file_info *fi)
  */
 static int cfuse_unlink(const char* relative_path)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   if (castorfs.readonly) return -EACCES;
 
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path,path);
+  cfuse_open_cache_invalidate(relative_path);
+  int spooled = castorfs.spool ? cfuse_spool_unlink(relative_path) : 0;
+  if (0 > spooled) return spooled;
   int res = rfio_unlink(path);
+  /* In ingest mode file can exist only in spool */
+  if (res == -1 && spooled && ENOENT == rfio_serrno()) return 0;
   if (res == -1) {
     DEBUG("cfuse_unlink: %s",rfio_serror());
     return -rfio_serrno();
@@ -502,8 +2597,11 @@ static int cfuse_unlink(const char* relative_path)
  */
 static int cfuse_mkdir(const char* relative_path, mode_t mode)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   if (castorfs.readonly) return -EACCES;
 
+  if (castorfs.ingest) return cfuse_spool_mkdir(relative_path,mode);
+
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path, path);
   int res = rfio_mkdir(path, mode);
@@ -520,9 +2618,13 @@ static int cfuse_mkdir(const char* relative_path, mode_t mode)
  */
 static int cfuse_rmdir(const char* relative_path)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   char path[PATH_SIZE_MAX];
   absolute_path(relative_path,path);
+  int spooled = castorfs.spool ? cfuse_spool_unlink(relative_path) : 0;
+  if (0 > spooled) return spooled;
   int res = rfio_rmdir(path);
+  if (res == -1 && spooled && ENOENT == rfio_serrno()) return 0;
   if (res == -1)  res = rfio_serrno();
 
   return res;
@@ -539,14 +2641,17 @@ static int cfuse_truncate(const char* relative_path, off_t size)
 {
 
   if (castorfs.readonly) return -EACCES;
+  if (castorfs.spool) {
+    int res = cfuse_spool_truncate(relative_path,size);
+    if (1 != res) return res;
+  }
   (void)size;
 
   // We can truncate only by recreating file
   struct fuse_file_info fi;
   int res = cfuse_create(relative_path,0644,&fi); // create
-  if ( 0 > res) return -rfio_serrno();
-  rfio_close(fi.fh); // close file handler
-  return res;
+  if ( 0 > res) return res;
+  return cfuse_handle_close(cfuse_handle_get(&fi)); // close file handler
 
 }
 /* ---------------------------------------------------------------------------------- */
@@ -575,6 +2680,7 @@ static int cfuse_utimens(const char *relative_path, const struct timespec ts[2])
  */
 static int cfuse_listxattr(const char *relative_path, char *list, size_t size)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   if (size==0) return XATTR_LIST_SIZE_MAX;
 
   struct Cns_segattrs *attrs;
@@ -605,9 +2711,21 @@ static int cfuse_listxattr(const char *relative_path, char *list, size_t size)
 static int cfuse_getxattr(const char *relative_path, const char *name, char *value,
       size_t size)
 {
+  if (0 != cfuse_set_caller_identity()) return -EACCES;
   if ( 0 == size) return XATTR_SIZE_MAX;
+  if (0 == strcmp(name,XATTR_SCHED_STATS) && 0 == strcmp(relative_path,"/"))
+    return cfuse_sched_print_stats(value,size);
+  if (0 == strcmp(name,XATTR_SPOOL_SYNC) && 0 == strcmp(relative_path,"/"))
+    return castorfs.spool ? cfuse_spool_sync(value,size) : -ENOTSUP;
   //fprintf(stderr,"name=%s\n",name);
   strncpy(value,"",size);
+  if (castorfs.spool && 0 == strcmp(name,XATTR_STATUS)) {
+    const char *spool_status = cfuse_spool_status(relative_path);
+    if (spool_status) {
+      strncpy(value,spool_status,size);
+      return strlen(value);
+    }
+  }
   struct Cns_filestat stat;
   int res = cfuse_cns_stat(relative_path ,&stat);
   if (0 > res) return res;
@@ -674,28 +2792,142 @@ static int cfuse_removexattr(const char *relative_path, const char *name)
 {
   return 0;
 }
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief Implementation of FUSE hook "init". Threads should be started here
+ *        and not in main, because fuse_main forks to background.
+ * @param  conn
+ * @return 
+ */
+static void* cfuse_init(struct fuse_conn_info *conn)
+{
+  (void)conn;
+  cfuse_close_queue_start();
+  /* Checked by main already, but without spool files can not be written */
+  int res = cfuse_spool_start();
+  if (0 != res) {
+    fprintf(stderr,"castorfs: could not open spool directory %s: %s\n",castorfs.spool,
+                                                                        strerror(-res));
+    fuse_exit(fuse_get_context()->fuse);
+  }
+  return NULL;
+}
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief Implementation of FUSE hook "destroy"
+ * @param  private_data
+ */
+static void cfuse_destroy(void *private_data)
+{
+  (void)private_data;
+  cfuse_spool_stop();
+  cfuse_close_queue_stop();
+}
 /** ---------------------------------------------------------------------------------- 
  * @} HOOKS
  *  ----------------------------------------------------------------------------------
  */
+
+/** 
+ * @brief  Define hook which runs FUSE hook cfuse_<name> in the scheduler slot
+ *         of the class cls
+ */
+#define CFUSE_SCHED_HOOK(name, cls, params, args) \
+static int cfuse_sched_##name params \
+{ \
+  struct cfuse_sched_ticket ticket; \
+  cfuse_sched_enter(&ticket,cls); \
+  int res = cfuse_##name args; \
+  cfuse_sched_leave(&ticket); \
+  return res; \
+}
+
+/** 
+ * @brief  Define hook like CFUSE_SCHED_HOOK, which first waits for background
+ *         commit of the file p, so it sees the complete file and its commit
+ *         error. The wait is outside of the slot: the commit needs a slot too.
+ */
+#define CFUSE_SCHED_FILE_HOOK(name, cls, params, args) \
+static int cfuse_sched_##name params \
+{ \
+  struct cfuse_sched_ticket ticket; \
+  cfuse_close_queue_wait(p); \
+  cfuse_sched_enter(&ticket,cls); \
+  int res = cfuse_##name args; \
+  cfuse_sched_leave(&ticket); \
+  return res; \
+}
+
+CFUSE_SCHED_FILE_HOOK(getattr, CFUSE_SCHED_META,
+    (const char *p, struct stat *stbuf), (p,stbuf))
+CFUSE_SCHED_HOOK(readdir, CFUSE_SCHED_META,
+    (const char *p, void *buf, fuse_fill_dir_t filler, off_t offset, 
+     struct fuse_file_info *fi), (p,buf,filler,offset,fi))
+CFUSE_SCHED_FILE_HOOK(create, CFUSE_SCHED_DATA,
+    (const char *p, mode_t mode, struct fuse_file_info *fi), (p,mode,fi))
+CFUSE_SCHED_FILE_HOOK(open, CFUSE_SCHED_DATA,
+    (const char *p, struct fuse_file_info *fi), (p,fi))
+CFUSE_SCHED_HOOK(read, CFUSE_SCHED_DATA,
+    (const char *p, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+    (p,buf,size,offset,fi))
+CFUSE_SCHED_HOOK(write, CFUSE_SCHED_DATA,
+    (const char *p, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+    (p,buf,size,offset,fi))
+CFUSE_SCHED_HOOK(unlink, CFUSE_SCHED_META, (const char *p), (p))
+CFUSE_SCHED_HOOK(mkdir, CFUSE_SCHED_META, (const char *p, mode_t mode), (p,mode))
+CFUSE_SCHED_HOOK(rmdir, CFUSE_SCHED_META, (const char *p), (p))
+CFUSE_SCHED_FILE_HOOK(truncate, CFUSE_SCHED_DATA, (const char *p, off_t size), (p,size))
+CFUSE_SCHED_HOOK(getxattr, CFUSE_SCHED_META,
+    (const char *p, const char *name, char *value, size_t size), (p,name,value,size))
+
+/* Spool barrier can wait for a long time and should not hold a slot */
+static int cfuse_sched_getxattr_sync(const char *p, const char *name, char *value,
+                                                                          size_t size)
+{
+  if (0 == strcmp(name,XATTR_SPOOL_SYNC)) return cfuse_getxattr(p,name,value,size);
+  return cfuse_sched_getxattr(p,name,value,size);
+}
+/* Small reads take a slot only for the whole batch, see cfuse_read_batched */
+static int cfuse_sched_read_small(const char *p, char *buf, size_t size, off_t offset,
+                                                             struct fuse_file_info *fi)
+{
+  if (NULL == cfuse_handle_get(fi)->spool && cfuse_read_is_small(size))
+    return cfuse_read(p,buf,size,offset,fi);
+  return cfuse_sched_read(p,buf,size,offset,fi);
+}
+CFUSE_SCHED_HOOK(listxattr, CFUSE_SCHED_META,
+    (const char *p, char *list, size_t size), (p,list,size))
+CFUSE_SCHED_HOOK(chown, CFUSE_SCHED_META, (const char *p, uid_t uid, gid_t gid), (p,uid,gid))
+/* ---------------------------------------------------------------------------------- */
+
+/* Hooks which do not call CASTOR (flush, fsync, utimens, ...) are not scheduled.
+ * Release only queues the file for background close, which waits for a data
+ * slot of the writer to commit written file (see cfuse_handle_close). So bulk
+ * writes and closes of one user are limited by the scheduler too. */
 static struct fuse_operations cfuse_oper = 
   {
-    .getattr = cfuse_getattr,
-    .readdir = cfuse_readdir,
-    .create = cfuse_create,
-    .open = cfuse_open,
-    .read = cfuse_read,
-    .write = cfuse_write,
+    .getattr = cfuse_sched_getattr,
+    .readdir = cfuse_sched_readdir,
+    .create = cfuse_sched_create,
+    .open = cfuse_sched_open,
+    .read = cfuse_sched_read_small,
+    .write = cfuse_sched_write,
+    .flush = cfuse_flush,
+    .fsync = cfuse_fsync,
     .release = cfuse_release,
-    .unlink = cfuse_unlink,
-    .mkdir = cfuse_mkdir,
-    .rmdir = cfuse_rmdir,
-    .truncate = cfuse_truncate,
+    .unlink = cfuse_sched_unlink,
+    .mkdir = cfuse_sched_mkdir,
+    .rmdir = cfuse_sched_rmdir,
+    .truncate = cfuse_sched_truncate,
     .utimens = cfuse_utimens,
-    .getxattr = cfuse_getxattr,
-    .listxattr = cfuse_listxattr,
+    .getxattr = cfuse_sched_getxattr_sync,
+    .listxattr = cfuse_sched_listxattr,
     .removexattr = cfuse_removexattr,
-    .chown = cfuse_chown
+    .chown = cfuse_sched_chown,
+    .init = cfuse_init,
+    .destroy = cfuse_destroy
   };
 
 static int cfuse_main(struct fuse_args *args)
@@ -739,8 +2971,32 @@ int main(int argc, char** argv)
   castorfs.stage_user     = NULL;
   castorfs.stage_host     = NULL;
   castorfs.stage_svcclass = NULL;
+  castorfs.sync_release   = 0;
+  castorfs.close_threads  = CLOSE_THREADS_DEFAULT;
+  castorfs.close_queue_size = CLOSE_QUEUE_SIZE_DEFAULT;
+  castorfs.no_keep_cache  = 0;
+  castorfs.multiuser      = 0;
+  castorfs.sched_slots    = SCHED_SLOTS_DEFAULT;
+  castorfs.sched_user_slots = 0;
+  castorfs.ns_rate        = 0;
+  castorfs.spool          = NULL;
+  castorfs.spool_uploaders = SPOOL_UPLOADERS_DEFAULT;
+  castorfs.spool_retries  = SPOOL_RETRIES_DEFAULT;
+  castorfs.read_window    = 0;
+  castorfs.read_gap       = READ_GAP_DEFAULT;
+  castorfs.read_small     = READ_SMALL_DEFAULT;
+  castorfs.ingest         = 0;
 
   int res = fuse_opt_parse(&args, &castorfs, castorfs_opts, cfuse_opt_proc);
+  if (castorfs.ingest && NULL == castorfs.spool) {
+    fprintf(stderr,"castorfs: castor_ingest needs castor_spool\n");
+    return 1;
+  }
+  if (0 > castorfs.read_window || 0 > castorfs.read_gap || 0 > castorfs.read_small) {
+    fprintf(stderr,"castorfs: castor_read_window, castor_read_gap and castor_read_small"
+                   " can not be negative\n");
+    return 1;
+  }
   // Without this readinf will not work
   fuse_opt_add_arg(&args,"-osync_read");
 
@@ -764,9 +3020,33 @@ int main(int argc, char** argv)
   {
     fprintf(stderr,"%d:%s ",i,args.argv[i]);
   }*/
+  // One slot is kept for metadata requests, data requests need one more
+  if (1 == castorfs.sched_slots) castorfs.sched_slots = 2;
+  if (0 >= castorfs.sched_user_slots) castorfs.sched_user_slots = (castorfs.sched_slots-1)/2;
+
   cfuse_init_xattrlist();
   Cthread_init();
-  cfuse_init_account();
+  if (castorfs.multiuser) {
+    // One mount for all users: identity is taken from each request
+    if (0 != cfuse_set_identity(getuid(),getgid())) {
+      fprintf(stderr,"castorfs: castor_multiuser: could not set CASTOR identity"
+                     " of requests\n");
+      return 1;
+    }
+    fuse_opt_add_arg(&args,"-oallow_other");
+  } else {
+    cfuse_init_account();
+  }
+  if (NULL != castorfs.spool) {
+    // Spool is used by threads started in init, check it with the same account
+    DIR *dir = opendir(castorfs.spool);
+    if (NULL == dir) {
+      fprintf(stderr,"castorfs: could not open spool directory %s: %s\n",castorfs.spool,
+                                                                        strerror(errno));
+      return 1;
+    }
+    closedir(dir);
+  }
   //cfuse_debug_account();
 
   res = cfuse_main(&args);